@@ -20,68 +20,42 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <lwip/dhcp.h>
+
 #include "OpenGarage.h"
+#include "filters.h"
 
 byte  OpenGarage::state = OG_STATE_INITIAL;
-File  OpenGarage::log_file;
 byte  OpenGarage::alarm = 0;
 byte  OpenGarage::led_reverse = 0;
 byte  OpenGarage::dirty_bits = 0xFF;
 Ticker ud_ticker;
-
-static const char* config_fname = CONFIG_FNAME;
-static const char* log_fname = LOG_FNAME;
-
+Ticker relay_ticker;
+uint  OpenGarage::relay_queue[RELAY_QUEUE_SIZE];
+byte  OpenGarage::relay_qhead = 0;
+byte  OpenGarage::relay_nqueued = 0;
+RelayPulseStruct OpenGarage::relay_pulse = {0, 0};
 OneWire* OpenGarage::oneWire = NULL;
 DallasTemperature* OpenGarage::ds18b20 = NULL;
 AM2320* OpenGarage::am2320 = NULL;
 DHTesp* OpenGarage::dht = NULL;
+byte  OpenGarage::th_state = TH_IDLE;
+ulong OpenGarage::th_time = 0;
+ulong OpenGarage::th_ud_mark = 0;
 extern OpenGarage og;
-/* Options name, default integer value, max value, default string value
- * Integer options don't have string value
- * String options don't have integer or max value
- */
-OptionStruct OpenGarage::options[] = {
-  {"fwv", OG_FWV,      255, ""},
-  {"mnt", OG_MNT_CEILING,3, ""},
-  {"dth", 50,        65535, ""},
-  {"vth", 150,       65535, ""},
-  {"riv", 5,           300, ""},
-  {"alm", OG_ALM_5,      2, ""},
-  {"aoo", 0,             1, ""},
-  {"lsz", DEFAULT_LOG_SIZE,400,""},
-  {"tsn", OG_TSN_NONE, 255, ""},
-  {"htp", 80,        65535, ""},
-  {"cdt", 1000,       5000, ""},
-  {"dri", 500,        3000, ""},
-  {"sto", 0,             1, ""},
-  {"mod", OG_MOD_AP,   255, ""},
-  {"ati", 30,          720, ""},
-  {"ato", OG_AUTO_NONE,255, ""},
-  {"atib", 3,           24, ""},
-  {"atob", OG_AUTO_NONE,255, ""},
-  {"noto", OG_NOTIFY_DO|OG_NOTIFY_DC,255, ""},
-  {"usi", 0,             1, ""},
-  {"ssid", 0, 0, ""},  // string options have 0 max value
-  {"pass", 0, 0, ""},
-  {"otf", 0, 0, DEFUALT_OTF_JSON},
-  {"dkey", 0, 0, DEFAULT_DKEY},
-  {"name", 0, 0, DEFAULT_NAME},
-  {"iftt", 0, 0, DEFAULT_IFTTT_JSON},
-  {"mqtt", 0, 0, DEFAULT_MQTT_JSON}, 
-  {"dvip", 0, 0, "-.-.-.-"},
-  {"gwip", 0, 0, "-.-.-.-"},
-  {"subn", 0, 0, "255.255.255.0"},
-  {"dns1", 0, 0, "8.8.8.8"}
-};
-
 /* Variables and functions for handling Ultrasonic Distance sensor */
 #define KAVG 7  // k average
 volatile uint32_t ud_start = 0;
-volatile byte ud_i = 0;
-volatile boolean fullbuffer = false;
-volatile uint32_t ud_buffer[KAVG];
 volatile boolean triggered = false;
+/* Single producer ring of raw samples. Only ud_isr writes the ring and
+ * ud_wr, it overwrites the oldest sample when the ring is full. Readers
+ * keep their own sample index and never mask interrupts: a sample is
+ * valid if it was not overwritten while it was being copied out. */
+volatile DistanceSample ud_ring[UD_RING_SIZE];
+volatile ulong ud_wr = 0;  // index of the next sample to be written
+ulong ud_rd = 0;           // next sample for ud_filter
+MedianFilter<uint32_t, DFW_MAX> ud_filter;
+uint32_t ud_last = 0;      // echo of the newest sample in ud_filter
 
 // start trigger signal
 void ud_start_trigger() {
@@ -102,21 +76,53 @@ ICACHE_RAM_ATTR void ud_isr() {
   } else {
     // ECHO pin went from high to low
     triggered = false;
-    ud_buffer[ud_i] = micros() - ud_start; // calculate elapsed time
-    if(ud_buffer[ud_i]>26000L) {
-    	// timedout
-    	if(og.options[OPTION_STO].ival==0) {
-    		// ignore
-    		return;
-    	} else {
-    		// cap to max
-	    	ud_buffer[ud_i]=26000L;
-    	}
+    uint32_t now = micros();
+    uint32_t echo = now - ud_start; // calculate elapsed time
+    volatile DistanceSample& s = ud_ring[ud_wr&(UD_RING_SIZE-1)];
+    s.ts = now;
+    if(echo>UD_ECHO_MAX) {
+      // timedout, the sensor timeout option is applied by the reader
+      s.echo = UD_ECHO_MAX;
+      s.flags = UD_FLAG_TIMEOUT;
     } else {
-		  ud_i = (ud_i+1)%KAVG; // circular buffer
-	    if(ud_i==0) fullbuffer=true;
-		}
+      s.echo = echo;
+      s.flags = 0;
+    }
+    ud_wr = ud_wr+1;  // publish the sample
+  }
+}
+
+// copy sample i out of the ring, returns false if it is
+// not written yet or has been overwritten
+bool ud_read(ulong i, DistanceSample& s) {
+  ulong n = ud_wr - i;
+  if(n==0 || n>UD_RING_SIZE) return false;
+  volatile DistanceSample& r = ud_ring[i&(UD_RING_SIZE-1)];
+  s.ts = r.ts;
+  s.echo = r.echo;
+  s.flags = r.flags;
+  // ud_isr may have run during the copy
+  return ud_wr - i <= UD_RING_SIZE;
+}
+
+// move the samples completed by ud_isr since the last call into the
+// median filter, returns the number of samples added to the filter
+byte ud_drain() {
+  ud_filter.set_window(og.options[OPTION_DFW].ival);
+  bool cap = og.options[OPTION_STO].ival;
+  byte n = 0;
+  DistanceSample s;
+  if(ud_wr - ud_rd > UD_RING_SIZE) {
+    ud_rd = ud_wr - UD_RING_SIZE;  // skip the samples we have missed
   }
+  for(;ud_rd != ud_wr;ud_rd++) {
+    if(!ud_read(ud_rd, s)) continue;
+    if((s.flags & UD_FLAG_TIMEOUT) && !cap) continue;  // ignore timeouts
+    ud_filter.push(s.echo);
+    ud_last = s.echo;
+    n++;
+  }
+  return n;
 }
 
 void ud_ticker_cb() {
@@ -167,170 +173,56 @@ void OpenGarage::begin() {
   }
 }
 
-void OpenGarage::options_setup() {
-  if(!SPIFFS.exists(config_fname)) { // if config file does not exist
-    options_save(); // save default option values
-    return;
-  } 
-  options_load();
-
-  if(options[OPTION_FWV].ival != OG_FWV)  {
-    // if firmware version has changed
-    // re-save options, thus preserving
-    // shared options with previous firmwares
-    options[OPTION_FWV].ival = OG_FWV;
-    options_save();
-    return;
-  }
-}
-
-void OpenGarage::options_reset() {
-  DEBUG_PRINT(F("reset to factory default..."));
-  if(!SPIFFS.remove(config_fname)) {
-    DEBUG_PRINTLN(F("failed to remove config file"));
-    return;
-  }else{DEBUG_PRINTLN(F("Removed config file"));}
-  DEBUG_PRINTLN(F("ok"));
-}
-
-void OpenGarage::log_reset() {
-  if(!SPIFFS.remove(log_fname)) {
-    DEBUG_PRINTLN(F("failed to remove log file"));
-    return;
-  }else{DEBUG_PRINTLN(F("Removed log file"));}
-  DEBUG_PRINTLN(F("ok"));  
+uint OpenGarage::read_distance() {
+  ud_drain();
+  return (uint)(ud_filter.median()*0.01716f);  // 34320 cm / 2 / 10^6 s
 }
 
-int OpenGarage::find_option(String name) {
-  for(byte i=0;i<NUM_OPTIONS;i++) {
-    if(name == options[i].name) {
-      return i;
-    }
-  }
-  return -1;
+uint OpenGarage::read_distance_last() {
+  ud_drain();
+  return (uint)(ud_last*0.01716f);
 }
 
-void OpenGarage::options_load() {
-  File file = SPIFFS.open(config_fname, "r");
-  DEBUG_PRINT(F("loading config file..."));
-  if(!file) {
-    DEBUG_PRINTLN(F("failed"));
-    return;
-  }
-  byte nopts = 0;
-  while(file.available()) {
-    String name = file.readStringUntil(':');
-    String sval = file.readStringUntil('\n');
-    sval.trim();
-    DEBUG_PRINT(name);
-    DEBUG_PRINT(":");
-    DEBUG_PRINTLN(sval);
-    nopts++;
-    if(nopts>NUM_OPTIONS+1) break;
-    int idx = find_option(name);
-    if(idx<0) continue;
-    if(options[idx].max) {  // this is an integer option
-      options[idx].ival = sval.toInt();
-    } else {  // this is a string option
-      options[idx].sval = sval;
-    }
-  }
-  // mqtt_config = get_mqtt_config();
-  // ifttt_config = get_ifttt_config();
-
-  DEBUG_PRINTLN(F("ok"));
-  file.close();
+// returns true if the echo ISR completed new valid samples since the last call
+bool OpenGarage::new_distance_sample() {
+  return ud_drain() > 0;
 }
 
-void OpenGarage::options_save() {
-  File file = SPIFFS.open(config_fname, "w");
-  DEBUG_PRINTLN(F("saving config file..."));  
-  if(!file) {
-    DEBUG_PRINTLN(F("failed"));
-    return;
-  }
-  OptionStruct *o = options;
-  for(byte i=0;i<NUM_OPTIONS;i++,o++) {
-    file.print(o->name + ":");
-    if(o->max)
-      file.println(o->ival);
-    else
-      file.println(o->sval);
+byte OpenGarage::get_distance_samples(DistanceSample *out, byte n) {
+  ulong w = ud_wr;
+  if(n>UD_RING_SIZE) n = UD_RING_SIZE;
+  if(n>w) n = w;
+  ulong i = w - n;
+  byte k = 0;
+  for(;n;n--,i++) {
+    if(ud_read(i, out[k])) k++;
   }
-  DEBUG_PRINTLN(F("ok"));  
-  file.close();
-  set_dirty_bit(DIRTY_BIT_JO, 1);
+  return k;
 }
 
-OTFStruct OpenGarage::get_otf_config() {
-  StaticJsonDocument<(JSON_OBJECT_SIZE(3) + 128)> doc;
-  DEBUG_PRINT(F("Deserializing OTF JSON: "));
-  DEBUG_PRINTLN(options[OPTION_OTF].sval);
-  deserializeJson(doc, options[OPTION_OTF].sval);
-  OTFStruct otf_config;
-
-  otf_config.domain = doc["dmin"].as<String>();
-  otf_config.port = doc["port"];
-  otf_config.token = doc["token"].as<String>();
-  return otf_config;
-}
-
-MqttStruct OpenGarage::get_mqtt_config() {
-  StaticJsonDocument<(JSON_OBJECT_SIZE(5) + 128)> doc;
-  DEBUG_PRINT(F("Deserializing MQTT JSON: "));
-  DEBUG_PRINTLN(options[OPTION_MQTT].sval);
-  deserializeJson(doc, options[OPTION_MQTT].sval);
-  MqttStruct mqtt_config;
-
-  mqtt_config.domain = doc["dmin"].as<String>();
-  mqtt_config.port = doc["port"];
-  mqtt_config.topic = doc["topic"].as<String>();
-  mqtt_config.username = doc["name"].as<String>();
-  mqtt_config.password = doc["pass"].as<String>();
-  return mqtt_config;
-}
-
-IFTTTStruct OpenGarage::get_ifttt_config() {
-  StaticJsonDocument<(JSON_OBJECT_SIZE(2) + 64)> doc;
-  DEBUG_PRINT(F("Deserializing IFTTT JSON: "));
-  DEBUG_PRINTLN(options[OPTION_IFTT].sval);
-  deserializeJson(doc, options[OPTION_IFTT].sval);
-  IFTTTStruct ifttt_config;
-
-  ifttt_config.token = doc["token"].as<String>();
-  ifttt_config.trigger = doc["trigger"].as<String>();
-  return ifttt_config;
+void OpenGarage::init_sensors() {
+  // set up distance sensors
+  init_distance_sensor();
+  attachInterrupt(PIN_ECHO, ud_isr, CHANGE);
+  init_TH_sensor();
 }
 
-uint OpenGarage::read_distance() {
-  byte i;
-  //unsigned long _time = 0;
-  uint32_t buf[KAVG];
-  noInterrupts(); // turn off interrupts while we read buffer
-  if(!fullbuffer) return ud_i>0? (uint)(ud_buffer[ud_i-1]*0.01716f) : 0;
-  // copy ud_buffer to local buffer
-  for(i=0;i<KAVG;i++) {
-    buf[i] = ud_buffer[i];
-  }
-  interrupts();
-  // partial sorting of buf to perform median filtering
-  byte out, in;
-  for(out=1; out<=KAVG/2; out++){ 
-    uint32_t temp = buf[out];
-    in = out;
-    while(in>0 && buf[in-1]>temp) {
-      buf[in] = buf[in-1]; 
-      in--;
-    }
-    buf[in] = temp;   
-  }  
-  return (uint)(buf[KAVG/2]*0.01716f);  // 34320 cm / 2 / 10^6 s
+void OpenGarage::init_distance_sensor() {
+  ud_ticker.detach();
+  ud_ticker.attach_ms(options[OPTION_DRI].ival, ud_ticker_cb);
 }
 
-void OpenGarage::init_sensors() {
-  // set up distance sensors
-  ud_ticker.attach_ms(options[OPTION_DRI].ival, ud_ticker_cb);
-  attachInterrupt(PIN_ECHO, ud_isr, CHANGE);
+void OpenGarage::init_TH_sensor() {
+  // release the driver of the previous sensor type
+  delete am2320;
+  am2320 = NULL;
+  delete dht;
+  dht = NULL;
+  delete ds18b20;
+  ds18b20 = NULL;
+  delete oneWire;
+  oneWire = NULL;
+  th_state = TH_IDLE;
 
   switch(options[OPTION_TSN].ival) {
   case OG_TSN_AM2320:
@@ -354,106 +246,108 @@ void OpenGarage::init_sensors() {
   }
 }
 
-void OpenGarage::read_TH_sensor(float& C, float& H) {
-	float v;
+/* Temperature / humidity readings never block the main loop. The
+ * DS18B20 conversion is started here and read back by TH_loop() once
+ * it is done. DHT sensors are bit-banged with interrupts disabled and
+ * the AM2320 blocks on I2C, so they are read by TH_loop() right after
+ * a distance echo has completed, where they do not delay ud_isr. */
+void OpenGarage::TH_start() {
+  if(th_state != TH_IDLE) return;  // the previous reading is still running
   switch(options[OPTION_TSN].ival) {
   case OG_TSN_AM2320:
-    if(am2320) {
-      if(am2320->measure()) {
-      	v = am2320->getTemperature();
-      	if(!isnan(v)) C=v;
-        v = am2320->getHumidity();
-        if(!isnan(v)) H=v;
-      }
-    }
-    break;
   case OG_TSN_DHT11:
   case OG_TSN_DHT22:
-    if(dht) {
-      TempAndHumidity th = dht->getTempAndHumidity();
-      v = th.temperature;
-      if(!isnan(v)) C=v;
-      v = th.humidity;
-      if(!isnan(v)) H=v;
-    }
+    th_time = millis();
+    th_ud_mark = ud_wr;
+    th_state = TH_WAIT_GAP;
     break;
 
   case OG_TSN_DS18B20:
     if(ds18b20) {
+      ds18b20->setWaitForConversion(false);
       ds18b20->requestTemperatures();
-      v=ds18b20->getTempCByIndex(0);
-      if(!isnan(v)) C=v;
+      th_time = millis() + ds18b20->millisToWaitForConversion(ds18b20->getResolution());
+      th_state = TH_CONVERTING;
     }
     break;
   }
 }
 
-bool OpenGarage::get_cloud_access_en() {
-  OTFStruct otf_config = get_otf_config();
-  if(otf_config.token.length()) {
-    return true;
-  }
-  return false;
-}
-
-void OpenGarage::write_log(const LogStruct& data) {
-  File file;
-  uint curr = 0;
-  DEBUG_PRINTLN(F("saving log data..."));  
-  if(!SPIFFS.exists(log_fname)) {  // create log file
-    file = SPIFFS.open(log_fname, "w");
-    if(!file) {
-      DEBUG_PRINTLN(F("failed"));
-      return;
+byte OpenGarage::TH_loop(float& C, float& H) {
+  float v;
+  byte got = 0;
+  switch(th_state) {
+  case TH_CONVERTING:
+    if((long)(millis()-th_time) < 0) return 0;
+    if(ds18b20) {
+      v = ds18b20->getTempCByIndex(0);
+      if(!isnan(v) && v != DEVICE_DISCONNECTED_C) { C=v; got |= TH_GOT_TEMP; }
     }
-    // fill log file
-    uint next = curr+1;
-    file.write((const byte*)&next, sizeof(next));
-    file.write((const byte*)&data, sizeof(LogStruct));
-    LogStruct l;
-    l.tstamp = 0;
-    for(;next<MAX_LOG_SIZE;next++) {  // pre-fill the log file to maximum size
-      file.write((const byte*)&l, sizeof(LogStruct));
+    break;
+
+  case TH_WAIT_GAP:
+    // wait for the next echo, unless the distance sensor is silent
+    if(millis()-th_time < 2*options[OPTION_DRI].ival) {
+      if(ud_wr == th_ud_mark) return 0;
+      if(triggered) {  // the next trigger went out already
+        th_ud_mark = ud_wr;
+        return 0;
+      }
     }
-  } else {
-    file = SPIFFS.open(log_fname, "r+");
-    if(!file) {
-      DEBUG_PRINTLN(F("failed"));
-      return;
+    if(am2320) {
+      if(am2320->measure()) {
+        v = am2320->getTemperature();
+        if(!isnan(v)) { C=v; got |= TH_GOT_TEMP; }
+        v = am2320->getHumidity();
+        if(!isnan(v)) { H=v; got |= TH_GOT_HUMID; }
+      }
+    } else if(dht) {
+      TempAndHumidity th = dht->getTempAndHumidity();
+      v = th.temperature;
+      if(!isnan(v)) { C=v; got |= TH_GOT_TEMP; }
+      v = th.humidity;
+      if(!isnan(v)) { H=v; got |= TH_GOT_HUMID; }
     }
-    file.readBytes((char*)&curr, sizeof(curr));
-    uint next = (curr+1) % options[OPTION_LSZ].ival;
-    file.seek(0, SeekSet);
-    file.write((const byte*)&next, sizeof(next));
+    break;
 
-    file.seek(sizeof(curr)+curr*sizeof(LogStruct), SeekSet);
-    file.write((const byte*)&data, sizeof(LogStruct));
+  default:
+    return 0;
   }
-  DEBUG_PRINTLN(F("ok"));      
-  file.close();
-  set_dirty_bit(DIRTY_BIT_JL, 1);
+  th_state = TH_IDLE;
+  return got;
 }
 
-bool OpenGarage::read_log_start() {
-  if(log_file) log_file.close();
-  log_file = SPIFFS.open(log_fname, "r");
-  if(!log_file) return false;
-  uint curr;
-  if(log_file.readBytes((char*)&curr, sizeof(curr)) != sizeof(curr)) return false;
-  if(curr>=MAX_LOG_SIZE) return false;
+/* Relay clicks are queued and timed by relay_ticker, so the caller
+ * returns right away and the loop keeps running while the relay is on.
+ * The click time is taken from the cdt option when the click is queued. */
+bool OpenGarage::click_relay() {
+  if(relay_nqueued >= RELAY_QUEUE_SIZE) return false;
+  relay_queue[(relay_qhead+relay_nqueued)%RELAY_QUEUE_SIZE] = options[OPTION_CDT].ival;
+  relay_nqueued++;
+  if(relay_nqueued == 1) relay_on();  // relay is idle
   return true;
 }
 
-bool OpenGarage::read_log_next(LogStruct& data) {
-  if(!log_file) return false;
-  if(log_file.readBytes((char*)&data, sizeof(LogStruct)) != sizeof(LogStruct)) return false;
-  return true;  
+void OpenGarage::relay_on() {
+  set_relay(HIGH);
+  relay_pulse.start = millis();
+  relay_pulse.end = 0;
+  relay_ticker.once_ms(relay_queue[relay_qhead], relay_off);
 }
 
-bool OpenGarage::read_log_end() {
-  if(!log_file) return false;
-  log_file.close();
-  return true;
+void OpenGarage::relay_off() {
+  set_relay(LOW);
+  relay_pulse.end = millis();
+  relay_qhead = (relay_qhead+1)%RELAY_QUEUE_SIZE;
+  relay_nqueued--;
+  if(relay_nqueued) relay_ticker.once_ms(RELAY_CLICK_GAP, relay_on);
+}
+
+bool OpenGarage::get_cloud_access_en() {
+  if(otf_config.token.length()) {
+    return true;
+  }
+  return false;
 }
 
 void OpenGarage::play_note(uint freq) {
@@ -467,15 +361,62 @@ void OpenGarage::play_note(uint freq) {
 
 void OpenGarage::config_ip() {
   if(options[OPTION_USI].ival) {
-    IPAddress dvip, gwip, subn, dns1;
-    if(dvip.fromString(options[OPTION_DVIP].sval) &&
-      gwip.fromString(options[OPTION_GWIP].sval) &&
-      subn.fromString(options[OPTION_SUBN].sval) &&
-      dns1.fromString(options[OPTION_DNS1].sval)) {
-      WiFi.config(dvip, gwip, subn, dns1, gwip);
+    uint dvip = options[OPTION_DVIP].ival;
+    uint gwip = options[OPTION_GWIP].ival;
+    uint subn = options[OPTION_SUBN].ival;
+    uint dns1 = options[OPTION_DNS1].ival;
+    if(dvip && gwip && subn && dns1) {
+      WiFi.config(IPAddress(dvip), IPAddress(gwip), IPAddress(subn), IPAddress(dns1), IPAddress(gwip));
     }
   }
 }
+/* The last good BSSID, channel and IP lease are kept in RTC user memory,
+ * which survives a restart but not a power cycle. They let the next
+ * connect skip the channel scan, and DHCP while the lease is valid. */
+bool OpenGarage::wifi_cache_load(WifiCacheStruct& c) {
+  if(!ESP.rtcUserMemoryRead(WIFI_CACHE_OFFSET, (uint32_t*)&c, sizeof(c))) return false;
+  if(c.magic != WIFI_CACHE_MAGIC) return false;
+  if(c.crc != crc32(&c.ssid_crc, sizeof(c)-2*sizeof(uint32_t))) return false;
+  const OptionString& ssid = options[OPTION_SSID].sval;
+  return c.ssid_crc == crc32(ssid.c_str(), ssid.length());
+}
+
+void OpenGarage::wifi_cache_save(uint32_t lease_left) {
+  WifiCacheStruct c;
+  memset(&c, 0, sizeof(c));
+  const OptionString& ssid = options[OPTION_SSID].sval;
+  c.magic = WIFI_CACHE_MAGIC;
+  c.ssid_crc = crc32(ssid.c_str(), ssid.length());
+  memcpy(c.bssid, WiFi.BSSID(), 6);
+  c.channel = WiFi.channel();
+  if(lease_left) {
+    c.has_ip = 1;
+    c.lease_left = lease_left;
+    c.ip = WiFi.localIP();
+    c.gw = WiFi.gatewayIP();
+    c.subn = WiFi.subnetMask();
+    c.dns = WiFi.dnsIP();
+  }
+  c.crc = crc32(&c.ssid_crc, sizeof(c)-2*sizeof(uint32_t));
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_OFFSET, (uint32_t*)&c, sizeof(c));
+}
+
+/* Seconds until the DHCP client renews the current lease (T1), 0 if
+ * the address was not granted by DHCP. A lease is reused only up to
+ * then, that's when the client would ask the server again anyway. */
+uint32_t OpenGarage::dhcp_lease_left() {
+  struct netif *nif = netif_default;
+  if(!nif || !dhcp_supplied_address(nif)) return 0;
+  struct dhcp *d = netif_dhcp_data(nif);
+  if(!d || d->t1_timeout <= d->lease_used) return 0;
+  return (uint32_t)(d->t1_timeout - d->lease_used) * DHCP_COARSE_TIMER_SECS;
+}
+
+void OpenGarage::wifi_cache_clear() {
+  uint32_t magic = 0;
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_OFFSET, &magic, sizeof(magic));
+}
+
 #include "pitches.h"
 
 void OpenGarage::play_startup_tune() {
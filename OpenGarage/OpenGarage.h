@@ -34,11 +34,52 @@
 
 #include "defines.h"
 
+// option metadata, see option_table
+struct OptionInfo {
+  char name[OPTION_NAME_SIZE+1];
+  uint32_t def;      // default of integer options
+  uint32_t min;
+  uint32_t max;      // 0 for string options
+  const char *sdef;  // default of string options, in PROGMEM
+  uint16_t size;     // arena size of string options, including the terminator
+  byte flags;        // OPTION_FLAG_*
+};
+
+/* A string option, stored in a fixed size slot of the option arena.
+ * Assigned values are cut to the capacity of the slot. */
+class OptionString {
+public:
+  OptionString() : buf(empty), size(0) {}
+  void bind(char *b, uint16_t n) { buf = n ? b : empty; size = n; buf[0] = 0; }
+  const char* c_str() const { return buf; }
+  uint length() const { return strlen(buf); }
+  uint capacity() const { return size ? size-1 : 0; }
+  OptionString& operator=(const char *s);
+  OptionString& operator=(const String& s) { return *this = s.c_str(); }
+  OptionString& operator=(const __FlashStringHelper *s);
+private:
+  char *buf;
+  uint16_t size;
+  static char empty[1];
+};
+
+// option values, IP options are kept packed in ival
 struct OptionStruct {
-  String name;
   uint ival;
-  uint max;
-  String sval;
+  OptionString sval;
+};
+
+/* Binary config file: this header followed by one record per option,
+ * a record is the zero padded name, a uint16_t length and the value
+ * (uint32_t for integer options, the null terminated string for string
+ * options). */
+struct ConfigHeader {
+  uint32_t magic;    // CONFIG_MAGIC
+  uint16_t version;  // CONFIG_VERSION
+  uint16_t nopts;
+  uint32_t layout;   // options_layout() of the firmware that wrote the file
+  uint32_t size;     // bytes of records following the header
+  uint32_t crc;      // of the records
 };
 
 struct OTFStruct {
@@ -53,6 +94,18 @@ struct MqttStruct {
   String username;
   String password;
   String topic;
+  bool tls;              // connect over TLS
+  String fingerprint;    // SHA1 fingerprint of the broker certificate, not checked if empty
+  bool persistent;       // keep the MQTT session across reconnects
+  // topics derived from topic, built once when the config is loaded
+  String topic_in;       // <topic>/IN/#
+  String topic_state;    // <topic>/OUT/STATE
+  String topic_status;   // <topic>/OUT/STATUS
+  String topic_notify;   // <topic>/OUT/NOTIFY
+  String topic_command;  // <topic>/OUT/COMMAND
+  String topic_json;     // <topic>/OUT/JSON
+  String topic_result;   // <topic>/OUT/RESULT
+  String topic_event;    // <topic>/OUT/EVENT
 };
 
 struct IFTTTStruct {
@@ -66,11 +119,42 @@ struct LogStruct {
   uint dist;    // distance
 };
 
+struct DistanceSample {
+  ulong ts;     // micros() at the end of the echo
+  ulong echo;   // echo time (us), capped to UD_ECHO_MAX
+  byte flags;   // UD_FLAG_*
+};
+
+struct RelayPulseStruct {
+  ulong start;  // millis() when the relay was turned on
+  ulong end;    // millis() when the relay was turned off, 0 while it is on
+};
+
+struct WifiCacheStruct {
+  uint32_t magic;
+  uint32_t crc;       // of the fields below
+  uint32_t ssid_crc;  // the cache is only used for the same SSID
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t has_ip;     // lease below is valid
+  uint32_t lease_left;  // seconds the lease could still be reused when the cache was saved
+  uint32_t ip;
+  uint32_t gw;
+  uint32_t subn;
+  uint32_t dns;
+};
+
+struct LogStatStruct {
+  ulong events;   // records logged
+  ulong flushes;  // staging buffer flushes
+  ulong writes;   // flash write calls
+  ulong bytes;    // bytes written to flash
+  ulong dropped;  // records lost because the staging buffer could not be flushed
+};
+
 class OpenGarage {
 public:
   static OptionStruct options[];
-  // static MqttStruct mqtt_config;
-  // static IFTTTStruct ifttt_config;
   static byte state;
   static byte alarm;
   static byte led_reverse;
@@ -78,17 +162,26 @@ public:
   static void begin();
   static void options_setup();
   static void options_load();
-  static void options_save();
+  static void options_save();     // applies the options now, writes them after CONFIG_SAVE_DELAY
+  static void options_process();  // write the options once they are due
+  static void options_flush();
   static void options_reset();
 
-  static OTFStruct get_otf_config();
-  static MqttStruct get_mqtt_config();
-  static IFTTTStruct get_ifttt_config();
+  // parsed copies of the JSON config options, rebuilt on options_load/options_save
+  static const OTFStruct& get_otf_config() { return otf_config; }
+  static const MqttStruct& get_mqtt_config() { return mqtt_config; }
+  static const IFTTTStruct& get_ifttt_config() { return ifttt_config; }
 
   static void restart() { ESP.restart();} //digitalWrite(PIN_RESET, LOW); }
-  static uint read_distance(); // centimeter
+  static uint read_distance(); // centimeter, median of the last dfw samples
+  static uint read_distance_last(); // centimeter, newest sample, unfiltered
+  static bool new_distance_sample();
+  static byte get_distance_samples(DistanceSample *out, byte n); // latest raw samples, oldest first
   static void init_sensors(); // initialize all sensor
-  static void read_TH_sensor(float& C, float &H);
+  static void init_distance_sensor();  // (re)arm the distance sensor with the current dri
+  static void init_TH_sensor();        // (re)create the driver for the current tsn
+  static void TH_start();  // start a reading, TH_loop() collects the result
+  static byte TH_loop(float& C, float& H);  // TH_GOT_* of the values updated
   static byte get_mode()   { return options[OPTION_MOD].ival; }
   static byte get_button() { return digitalRead(PIN_BUTTON); }
   static byte get_switch() { return digitalRead(PIN_SWITCH); }
@@ -96,11 +189,9 @@ public:
   static bool get_cloud_access_en();
   static void set_led(byte status)   { digitalWrite(PIN_LED, led_reverse?(!status):status); }
   static void set_relay(byte status) { digitalWrite(PIN_RELAY, status); }
-  static void click_relay() {
-    set_relay(HIGH);
-    delay(options[OPTION_CDT].ival);
-    set_relay(LOW);
-  }
+  static bool click_relay();  // queue a relay click, returns false if the queue is full
+  static byte get_relay_queued() { return relay_nqueued; }
+  static const RelayPulseStruct& get_relay_pulse() { return relay_pulse; }
   static void set_dirty_bit(byte bit, byte value) {
     if(value==0) dirty_bits &= ~(1<<bit);
     else dirty_bits |= (1<<bit);
@@ -108,9 +199,20 @@ public:
   static byte get_dirty_bit(byte bit) {
     return (dirty_bits >> bit) & 1;
   }
-  static int find_option(String name);
+  static int find_option(const char *name, size_t len);
+  static void option_info(byte i, OptionInfo& info);
+  static const __FlashStringHelper* option_name(byte i);
+  static uint option_max(byte i);  // 0 for string options
+  static byte option_flags(byte i);
+  static bool parse_ip_option(const char *s, uint& ival);
+  static void log_setup();
   static void log_reset();
+  static ulong get_log_seq()    { return log_seq; }    // sequence number of the newest record
+  static ulong get_log_newest() { return log_newest; } // time stamp of the newest record
   static void write_log(const LogStruct& data);
+  static void log_process();  // flush staged log records once they are due
+  static void log_flush();
+  static const LogStatStruct& get_log_stats() { return log_stats; }
   static bool read_log_start();
   static bool read_log_next(LogStruct& data);
   static bool read_log_end();
@@ -121,15 +223,48 @@ public:
   }
   static void reset_alarm() { alarm = 0; }
   static void reset_to_ap() {
+    log_flush();
     options[OPTION_MOD].ival = OG_MOD_AP;
     options_save();
+    options_flush();
     restart();
   }
   static void config_ip();
+  static bool wifi_cache_load(WifiCacheStruct& c);
+  static void wifi_cache_save(uint32_t lease_left);  // 0 to not keep the lease
+  static uint32_t dhcp_lease_left();
+  static void wifi_cache_clear();
+  static uint32_t crc32(const void *data, size_t len, uint32_t crc=0);
   static void play_startup_tune();
 private:
+  static void parse_configs();
+  static bool options_read(const char *fname);
+  static bool options_read_text();
+  static void options_defaults();
+  static ulong options_save_time;  // millis() of the last change or failed write, 0 if nothing to write
+  static OTFStruct otf_config;
+  static MqttStruct mqtt_config;
+  static IFTTTStruct ifttt_config;
   static ulong read_distance_once();
   static File log_file;
+  static bool log_exists;
+  static uint log_head;     // ring index the next record is written to
+  static uint log_count;    // number of records in the log file
+  static ulong log_newest;
+  static ulong log_seq;
+  static LogStruct log_stage[];
+  static byte log_nstaged;
+  static ulong log_stage_time;  // millis() when the oldest staged record was added
+  static LogStatStruct log_stats;
+  static uint log_rd_idx;   // ring index of the last record read
+  static uint log_rd_left;  // number of records left to read
+  static byte log_rd_staged;  // number of staged records left to read
+  static void relay_on();
+  static void relay_off();
+  static uint relay_queue[];  // click times (ms) of the pending clicks
+  static byte relay_qhead;
+  static byte relay_nqueued;  // pending clicks, including the one in progress
+  static RelayPulseStruct relay_pulse;  // last click
   static void button_handler();
   static void led_handler();
   
@@ -137,6 +272,9 @@ private:
   static DallasTemperature* ds18b20;
   static AM2320* am2320;
   static DHTesp* dht;
+  static byte th_state;
+  static ulong th_time;     // millis() when the reading was started or is due
+  static ulong th_ud_mark;  // distance sample index when the reading was started
 };
 
 #endif  // _OPENGARAGE_H_
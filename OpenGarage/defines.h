@@ -41,9 +41,13 @@
 // Default device key
 #define DEFAULT_DKEY    "opendoor"
 // Config file name
-#define CONFIG_FNAME    "/config.dat"
+#define CONFIG_FNAME    "/config.bin"
+#define CONFIG_TMP_FNAME "/config.tmp"  // written first, then renamed to CONFIG_FNAME
+#define CONFIG_TXT_FNAME "/config.dat"  // text config of earlier firmwares, migrated on boot
 // Log file name
 #define LOG_FNAME       "/log.dat"
+// MQTT outbox file name
+#define OUTBOX_FNAME    "/outbox.dat"
 
 // store nested objects as strings
 #define DEFAULT_MQTT_JSON     R"({"dmin": "-.-.-.-", "port": 1883, "name": "", "pass": "", "topic": "opengarage"})"
@@ -65,6 +69,14 @@
 #define OG_TSN_DHT22    0x03
 #define OG_TSN_DS18B20  0x04
 
+// temperature / humidity reading states
+#define TH_IDLE         0
+#define TH_CONVERTING   1   // DS18B20 conversion running
+#define TH_WAIT_GAP     2   // waiting for a gap between distance sensor echoes
+// TH_loop() results
+#define TH_GOT_TEMP     0x01
+#define TH_GOT_HUMID    0x02
+
 #define OG_MOD_AP       0xA9
 #define OG_MOD_STA      0x2A
 
@@ -94,7 +106,21 @@ enum {
 
 #define DEFAULT_LOG_SIZE    100
 #define MAX_LOG_SIZE       500
+#define LOG_STAGE_SIZE       8    // log records kept in RAM before they are written to flash
+#define LOG_FLUSH_INTERVAL 15000  // staged log records are flushed after at most this many ms
+
+#define CONFIG_MAGIC      0x4E43474F  // "OGCN"
+#define CONFIG_VERSION    1
+#define CONFIG_NAME_SIZE  OPTION_NAME_SIZE  // option names are stored zero padded to this size
+#define CONFIG_MAX_SIZE   4096    // larger config files are rejected
+#define CONFIG_SAVE_DELAY 2000    // ms option changes are held before they are written
 #define ALARM_FREQ         1000
+#define RELAY_QUEUE_SIZE     4    // relay clicks that can be pending
+#define RELAY_CLICK_GAP    500    // ms between two queued relay clicks
+#define DFW_MAX              31   // maximum distance filter window (samples)
+#define UD_RING_SIZE         16   // raw distance samples kept by the echo ISR (power of 2)
+#define UD_ECHO_MAX       26000L  // echo timeout (us)
+#define UD_FLAG_TIMEOUT    0x01   // no echo within UD_ECHO_MAX
 // door status histogram
 // number of values (maximum is 8)
 #define DOOR_STATUS_HIST_K  4
@@ -125,6 +151,11 @@ typedef enum {
   OPTION_ATOB,    // automation options B
   OPTION_NOTO,    // notification options
   OPTION_USI,     // use static IP
+  OPTION_DDB,     // distance deadband for status push (cm)
+  OPTION_TDB,     // temperature deadband for status push (0.1 C)
+  OPTION_DFW,     // distance filter window (samples)
+  OPTION_CMR,     // retry a door command once if the door did not move
+  OPTION_THB,     // MQTT telemetry heartbeat (seconds), 0 to disable
   OPTION_SSID,    // wifi ssid
   OPTION_PASS,    // wifi password
   OPTION_OTF,     // OTF stringified JSON
@@ -139,6 +170,41 @@ typedef enum {
   NUM_OPTIONS     // number of options
 } OG_OPTION_enum;
 
+#define OPTION_NAME_SIZE    4
+#define OPTION_HASH_SIZE   80    // slots of the option name hash
+#define OPTION_HASH_SEED  994    // gives distinct slots for all option names
+#define OPTION_FLAG_LOCKED 0x01  // cannot be changed through /co or MQTT
+#define OPTION_FLAG_SECRET 0x02  // not reported by /jo
+#define OPTION_FLAG_JSON   0x04  // stringified JSON, reported as is by /jo
+#define OPTION_FLAG_IP     0x08  // IPv4 address, packed into ival
+#define OPTION_BIT(i)      (1ULL<<(i))  // NUM_OPTIONS must not exceed 64
+#define OPTION_IP(a,b,c,d) ((uint32_t)(a) | (uint32_t)(b)<<8 | (uint32_t)(c)<<16 | (uint32_t)(d)<<24)
+
+// door command tracking
+#define CMD_NONE            0
+#define CMD_PENDING         1   // waiting for the alarm and relay click
+#define CMD_MOVING          2   // relay clicked, waiting for the door to reach the target state
+#define CMD_COMPLETED       3
+#define CMD_FAILED          4
+#define CMD_TIMEOUT     30000   // ms allowed for each step
+#define CMD_HIST_BUCKETS    6   // latency histogram: <1s, <2s, <4s, <8s, <16s, >=16s
+
+// MQTT reconnect
+#define MQTT_CONNECT_TIMEOUT  2000    // ms allowed for the TCP connect and for the broker's reply
+#define MQTT_TLS_TIMEOUT      5000    // ms allowed for the TCP connect and TLS handshake
+#define MQTT_TLS_MFLN_MIN   512       // TLS fragment lengths probed, doubled up to MQTT_TLS_MFLN_MAX
+#define MQTT_TLS_MFLN_MAX  4096
+#define MQTT_TLS_TX         512       // TLS transmit buffer
+#define MQTT_BACKOFF_MIN      2000    // ms before the first retry, doubled after every failure
+#define MQTT_BACKOFF_MAX    300000L
+#define MQTT_DNS_TTL       3600000L   // ms the resolved broker address is reused
+#define MQTT_RSSI_DB          5       // RSSI deadband for MQTT telemetry (dBm)
+#define MQTT_WAIT             0       // connect states
+#define MQTT_RESOLVE          1
+#define MQTT_TCP              2
+#define MQTT_HANDSHAKE        3
+#define MQTT_PROBE            4
+
 // if button is pressed for 1 seconds, report IP
 #define BUTTON_REPORTIP_TIMEOUT 800
 // if button is pressed for at least 5 seconds, reset to AP mode
@@ -146,6 +212,33 @@ typedef enum {
 // if button is pressed for at least 10 seconds, factory reset
 #define BUTTON_FACRESET_TIMEOUT  9500
 
+// WiFi connection cached in RTC memory
+#define WIFI_CACHE_MAGIC   0x4F475743  // "OGWC"
+#define WIFI_CACHE_OFFSET  0           // RTC user memory offset (4 byte blocks)
+#define WIFI_CACHE_REFRESH 60000L      // ms between updates of the cached lease time while connected
+#define WIFI_FAST_TIMEOUT  5000        // ms to connect with the cached BSSID before a full scan
+#define WIFI_CONNECT_TIMEOUT 60000L    // ms before falling back to retrying with backoff
+#define WIFI_RETRY_MIN    10000L       // ms before re-associating after a lost connection, doubled after every try
+#define WIFI_RETRY_MAX   300000L
+
+// status push (websocket) port
+#define WS_PORT         81
+
+// MQTT outbox: events kept in flash until the broker can be reached
+#define OUTBOX_SIZE          32
+#define OUTBOX_MSG_SIZE      80
+#define OUTBOX_DOOR           0   // door opened or closed
+#define OUTBOX_NOTIFY         1   // notification text, only queued by earlier firmware
+
+// notification queue
+#define NOTIFY_QUEUE_SIZE     4
+#define NOTIFY_MAX_TRIES      4       // a notification is dropped after this many failed attempts
+#define NOTIFY_RETRY_BASE  2000       // ms before the first retry, doubled on every retry
+#define NOTIFY_TIMEOUT     5000       // ms allowed for the IFTTT reply
+#define NOTIFY_CONNECT_TIMEOUT 2000   // ms allowed for the IFTTT DNS lookup and for the connect, each blocks the loop
+#define NOTIFY_DNS_TTL  3600000L      // ms the resolved IFTTT address is reused
+#define IFTTT_HOST "maker.ifttt.com"
+
 #define LED_FAST_BLINK 100
 #define LED_SLOW_BLINK 500
 
@@ -24,31 +24,16 @@
 
 //const char html_ap_redirect[] PROGMEM = "<h3>WiFi config saved. Now switching to station mode.</h3>";
 
-String scan_network() {
+/* Scan for networks and return how many were found. The results stay
+ * with the WiFi library (WiFi.SSID(i), WiFi.RSSI(i)) until the next scan. */
+byte scan_network() {
   DEBUG_PRINTLN(F("scan network"));
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
-  byte n = WiFi.scanNetworks();
-  String wirelessinfo;
+  int8_t n = WiFi.scanNetworks();
+  if (n<0) n = 0;
   if (n>32) n = 32; // limit to 32 ssids max
-   //Maintain old format of wireless network JSON for mobile app compat
-   wirelessinfo = "{\"ssids\":["; 
-  for(int i=0;i<n;i++) {
-    wirelessinfo += "\"";
-    wirelessinfo += WiFi.SSID(i);
-    wirelessinfo += "\"";
-    if(i<n-1) wirelessinfo += ",\r\n";
-  }
-  wirelessinfo += "],";
-  wirelessinfo += "\"rssis\":["; 
-  for(int i=0;i<n;i++) {
-    wirelessinfo += "\"";
-    wirelessinfo += WiFi.RSSI(i);
-    wirelessinfo += "\"";
-    if(i<n-1) wirelessinfo += ",\r\n";
-  }
-  wirelessinfo += "]}";
-  return wirelessinfo;
+  return n;
 }
 
 void start_network_ap(const char *ssid, const char *pass) {
@@ -62,7 +47,7 @@ void start_network_ap(const char *ssid, const char *pass) {
   WiFi.disconnect();  // disconnect from router
 }
 
-void start_network_sta(const char *ssid, const char *pass, bool staonly) {
+void start_network_sta(const char *ssid, const char *pass, bool staonly, int32_t channel=0, const uint8_t *bssid=NULL) {
   if(!ssid || !pass) return;
   DEBUG_PRINTLN(F("Sarting start_network_sta"));
   if(staonly){
@@ -74,7 +59,7 @@ void start_network_sta(const char *ssid, const char *pass, bool staonly) {
     if(WiFi.getMode() != WIFI_AP_STA) WiFi.mode(WIFI_AP_STA);
     DEBUG_PRINTLN(F("Setting to AP+STA mode"));
   }
-  WiFi.begin(ssid, pass);
+  WiFi.begin(ssid, pass, channel, bssid);
 }
 
 void start_network_sta_with_ap(const char *ssid, const char *pass) {
@@ -85,3 +70,8 @@ void start_network_sta(const char *ssid, const char *pass) {
   start_network_sta(ssid, pass, true);
 }
 
+// connect to a known access point without scanning
+void start_network_sta(const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid) {
+  start_network_sta(ssid, pass, true, channel, bssid);
+}
+
@@ -45,9 +45,10 @@
 #include "defines.h"
 #include "htmls.h"
 
-String scan_network();
+byte scan_network();
 void start_network_ap(const char *ssid, const char *pass);
 void start_network_sta(const char *ssid, const char *pass);
+void start_network_sta(const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid);
 void start_network_sta_with_ap(const char *ssid, const char *pass);
 
 #endif
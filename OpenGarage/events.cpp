@@ -0,0 +1,68 @@
+/* OpenGarage Firmware
+ *
+ * MQTT event publisher
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "events.h"
+#include "jsonwriter.h"
+#include "OpenGarage.h"
+
+PubSubClient* Events::mqttclient = NULL;
+
+/* The MQTT connection only notices a lost link when its socket times
+ * out, until then connected() is still true and a publish goes into
+ * a dead socket. Events are only sent directly while WiFi is up. */
+bool Events::online() {
+  return mqttclient && WiFi.status() == WL_CONNECTED && mqttclient->connected();
+}
+
+bool Events::publish(const OutboxStruct& r) {
+  char buf[160];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object();
+  w.member(F("ts"), r.tstamp);
+  if(r.type == OUTBOX_DOOR) {
+    w.member(F("type"), F("door"));
+    w.member(F("state"), r.msg);
+  } else {  // queued by earlier firmware
+    w.member(F("type"), F("notify"));
+    w.member(F("msg"), r.msg);
+  }
+  w.end_object();
+  if(w.overflow()) return true;  // can never be sent, don't retry
+  return mqttclient->publish(OpenGarage::get_mqtt_config().topic_event.c_str(), w.c_str());
+}
+
+void Events::queue(byte type, ulong tstamp, const char *msg) {
+  if(OpenGarage::get_mqtt_config().domain.length()<=8) return;
+  OutboxStruct r;
+  r.tstamp = tstamp;
+  r.type = type;
+  strncpy(r.msg, msg, OUTBOX_MSG_SIZE-1);
+  r.msg[OUTBOX_MSG_SIZE-1] = 0;
+  if(!Outbox::size() && online() && publish(r)) return;
+  Outbox::push(type, r.tstamp, r.msg);
+}
+
+void Events::drain() {
+  OutboxStruct r;
+  if(!online() || !Outbox::peek(r)) return;
+  if(publish(r)) Outbox::pop();
+}
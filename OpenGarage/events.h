@@ -0,0 +1,52 @@
+/* OpenGarage Firmware
+ *
+ * MQTT event publisher header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+#include "defines.h"
+#include "outbox.h"
+
+/* Door events go to <topic>/OUT/EVENT as JSON with their original
+ * time stamp. When the broker can't be reached, or older events are
+ * still waiting, the event is kept in the flash outbox and sent by
+ * drain() once the connection is back. PubSubClient publishes with
+ * QoS 0 only, so delivery is at most once: an event counts as sent
+ * once it is written to the connection, if that drops before the
+ * broker has it the event is lost. Notifications are not queued here,
+ * Notifier sends them as plain text to <topic>/OUT/NOTIFY. */
+class Events {
+public:
+  static void begin(PubSubClient *mqtt) { mqttclient = mqtt; }
+  static void queue(byte type, ulong tstamp, const char *msg);
+  static void drain();  // send the oldest buffered event, one per loop pass
+private:
+  static bool online();
+  static bool publish(const OutboxStruct& r);
+  static PubSubClient *mqttclient;
+};
+
+#endif  // _EVENTS_H
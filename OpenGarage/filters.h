@@ -0,0 +1,83 @@
+/* OpenGarage Firmware
+ *
+ * Sample filters header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILTERS_H
+#define _FILTERS_H
+
+#include <Arduino.h>
+
+/* Sliding-window median filter over the last 'window' samples,
+ * window is runtime adjustable up to N.
+ * Samples are kept both in arrival order (ring) and in sorted order,
+ * push() moves the new sample into place in the sorted array in
+ * O(window), median() is constant time. */
+template<typename T, byte N>
+class MedianFilter {
+public:
+  MedianFilter() : win(N), head(0), n(0) {}
+
+  // change the window size, this clears the filter
+  void set_window(byte w) {
+    if(w<1) w=1;
+    if(w>N) w=N;
+    if(w==win) return;
+    win = w;
+    reset();
+  }
+  byte window() const { return win; }
+  byte size() const { return n; }
+  void reset() { head = 0; n = 0; }
+
+  void push(T v) {
+    byte i;
+    if(n<win) {
+      ring[(head+n)%win] = v;
+      i = n++;
+    } else {
+      // replace the oldest sample
+      T old = ring[head];
+      ring[head] = v;
+      head = (head+1)%win;
+      for(i=0;i<n-1 && sorted[i]!=old;i++);
+    }
+    sorted[i] = v;
+    // restore sorted order around the new sample
+    while(i>0 && sorted[i-1]>sorted[i]) { swap(i-1, i); i--; }
+    while(i+1<n && sorted[i+1]<sorted[i]) { swap(i, i+1); i++; }
+  }
+
+  T median() const {
+    if(!n) return 0;
+    if(n&1) return sorted[n/2];
+    return (sorted[n/2-1] + sorted[n/2])/2;
+  }
+
+private:
+  void swap(byte a, byte b) { T t = sorted[a]; sorted[a] = sorted[b]; sorted[b] = t; }
+  T ring[N];    // samples in arrival order
+  T sorted[N];  // the same samples in ascending order
+  byte win;
+  byte head;    // oldest sample in ring
+  byte n;       // number of samples held
+};
+
+#endif  // _FILTERS_H
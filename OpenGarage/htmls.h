@@ -218,9 +218,32 @@ var err = error;
 $('#msg').text('Request Failed: ' + err).css('color','red');
 });
 });
-$(document).ready(function() { show(); si=setInterval('show()', 5000); });
+var st={}, ws=null, lastpoll=0;
+$(document).ready(function() { show(); connect_ws(); si=setInterval(poll, 1000); });
+// status changes are pushed over a websocket; polling /jc is the
+// fallback, and only refreshes slowly while the push channel is open
+function poll() {
+var t=Date.now();
+if(t-lastpoll >= ((ws&&ws.readyState==1)?30000:5000)) show();
+}
+function connect_ws() {
+if(!window.WebSocket) return;
+try { ws=new WebSocket('ws://'+location.hostname+':81/'); } catch(e) { ws=null; return; }
+ws.onmessage=function(e) {
+var jd=JSON.parse(e.data);
+for(var k in jd) st[k]=jd[k];
+if(typeof(st.fwv)!='undefined') render(st);
+};
+ws.onclose=function() { ws=null; setTimeout(connect_ws, 10000); };
+}
 function show() {
+lastpoll=Date.now();
 $.getJSON('jc', function(jd) {
+for(var k in jd) st[k]=jd[k];
+render(st);
+});
+}
+function render(jd) {
 $('#fwv').text((jd.fwv/100>>0)+'.'+(jd.fwv/10%10>>0)+'.'+(jd.fwv%10>>0));
 $('#lbl_dist').text(jd.dist +' (cm)').css('color', jd.dist==450?'red':'black');
 $('#lbl_status').text(jd.door?'OPEN':'CLOSED').css('color',jd.door?'red':'green'); 
@@ -245,7 +268,6 @@ $('#head_name').text(jd.name);
 $('#btn_click').html(jd.door?'Close Door':'Open Door').button('refresh');
 if(typeof(jd.temp)!='undefined') {$('#tbl_th').show(); $('#lbl_th').text(jd.temp.toFixed(1)+String.fromCharCode(176)+'C / '+(jd.temp*1.8+32).toFixed(1)+String.fromCharCode(176)+'F (H:'+jd.humid.toFixed(1)+'%)');}
 else {$('#tbl_th').hide();}
-});
 }
 </script>
 </body>
@@ -274,6 +296,8 @@ const char sta_logs_html[] PROGMEM = R"(<head>
 <script>
 var curr_time = 0;
 var date = new Date();
+var logs = [];
+var seq = null;
 $("#btn_back").click(function(){history.back();});
 $(document).ready(function(){
 show_log();
@@ -285,12 +309,17 @@ date.setTime(curr_time*1000);
 $('#lbl_time').text(date.toLocaleString());
 }
 function show_log() {
-$.getJSON('jl', function(jd) {
+$.getJSON('jl'+(seq===null?'':'?cursor='+seq), function(jd) {
 $('#lbl_name').text(jd.name);
-curr_time = jd.time;
+if(jd.time>curr_time) curr_time = jd.time;  // a 304 revalidated response carries an older time
+seq = jd.seq;
+if(jd.inc) {
+if(!jd.logs.length) return;
+logs = jd.logs.concat(logs).slice(0, jd.lsz);  // the device keeps only lsz records
+} else {
+logs = jd.logs;
+}
 $('#tab_log').find('tr:gt(0)').remove();
-var logs=jd.logs;
-logs.sort(function(a,b){return b[0]-a[0];});
 $('#lbl_nr').text(logs.length);
 var ldate = new Date();
 for(var i=0;i<logs.length;i++) {
@@ -330,6 +359,7 @@ const char sta_options_html[] PROGMEM = R"(<head><title>OpenGarage</title><meta
 <tr><td><b>Read Interval (s):</b></td><td><input type='text' size=3 maxlength=3 id='riv' data-mini='true' value=0></td></tr>
 <tr><td><b>Click Time (ms):</b></td><td><input type='text' size=3 maxlength=5 id='cdt' value=0 data-mini='true'></td></tr>
 <tr><td><b>Dist. Read (ms):</b></td><td><input type='text' size=3 maxlength=5 id='dri' value=0 data-mini='true'></td></tr>
+<tr><td><b>Dist. Filter (reads):</b></td><td><input type='text' size=3 maxlength=2 id='dfw' value=0 data-mini='true'></td></tr>
 <tr><td><b>Sensor Timeout:</b></td><td>
 <fieldset data-role='controlgroup' data-mini='true' data-type='horizontal'>
 <input type='radio' name='rd_to' id='to_ignore' value=0><label for='to_ignore'>Ignore</label>
@@ -343,6 +373,7 @@ const char sta_options_html[] PROGMEM = R"(<head><title>OpenGarage</title><meta
 <option value=2>10 seconds</option>
 </select></td></tr>
 <tr><td colspan=2><input type='checkbox' id='aoo' data-mini='true'><label for='aoo'>Do not alarm when opening</label></td></tr>
+<tr><td colspan=2><input type='checkbox' id='cmr' data-mini='true'><label for='cmr'>Retry if door does not move</label></td></tr>
 <tr><td><b>Log Size:<a href='#lszInfo' data-rel='popup' data-role='button' data-inline='true' data-transition='pop' data-icon='info' data-theme='c' data-iconpos='notext'>Important note</a><div data-role='popup' id='lszInfo' class='ui-content' data-theme='b' style='max-width:320px;'><p>If you change log size, please Clear Log for the new size to take effect.</p></div></b></td><td>
 <select name='lsz' id='lsz' data-mini='true'>
 <option value=20>20</option>
@@ -384,6 +415,9 @@ const char sta_options_html[] PROGMEM = R"(<head><title>OpenGarage</title><meta
 <div id='div_other' style='display:none;'>
 <table cellpadding=2>
 <tr><td><b>HTTP Port:</b></td><td><input type='text' size=5 maxlength=5 id='htp' value=0 data-mini='true'></td></tr>
+<tr><td><b>Push Dist. Band (cm):</b></td><td><input type='text' size=3 maxlength=3 id='ddb' value=0 data-mini='true'></td></tr>
+<tr><td><b>Push Temp. Band (0.1&deg;C):</b></td><td><input type='text' size=3 maxlength=3 id='tdb' value=0 data-mini='true'></td></tr>
+<tr><td><b>MQTT Heartbeat (s):</b></td><td><input type='text' size=3 maxlength=4 id='thb' value=0 data-mini='true'></td></tr>
 <tr><td colspan=2><input type='checkbox' id='usi' data-mini='true'><label for='usi'>Use Static IP</label></td></tr>
 <tr><td><b>Device IP:</b></td><td><input type='text' size=15 maxlength=15 id='dvip' data-mini='true' disabled></td></tr>
 <tr><td><b>Gateway IP:</b></td><td><input type='text' size=15 maxlength=15 id='gwip' data-mini='true' disabled></td></tr>
@@ -452,11 +486,16 @@ comm+='&vth='+$('#vth').val();
 comm+='&riv='+$('#riv').val();
 comm+='&alm='+$('#alm').val();
 comm+='&aoo='+($('#aoo').is(':checked')?1:0);
+comm+='&cmr='+($('#cmr').is(':checked')?1:0);
 comm+='&lsz='+$('#lsz').val();
 comm+='&tsn='+$('#tsn').val();
 comm+='&htp='+$('#htp').val();
+comm+='&ddb='+$('#ddb').val();
+comm+='&tdb='+$('#tdb').val();
+comm+='&thb='+$('#thb').val();
 comm+='&cdt='+$('#cdt').val();
 comm+='&dri='+$('#dri').val();
+comm+='&dfw='+$('#dfw').val();
 comm+='&sto='+eval_cb('#to_cap');
 comm+='&ati='+$('#ati').val();
 comm+='&atib='+$('#atib').val();
@@ -492,7 +531,7 @@ if(jd.result!=1) {
 if(jd.result==2) show_msg('Check device key and try again.');
 else show_msg('Error code: '+jd.result+', item: '+jd.item);
 } else {
-$('#msg').html('<font color=green>Options are saved. Many options may need<br>a reboot to take effect. If you changed log<br>size, please Clear Log for it to take effect.</font>');
+$('#msg').html('<font color=green>Options are saved and in effect. Static IP<br>changes take effect after a reboot. If you<br>changed log size, please Clear Log for it<br>to take effect.</font>');
 setTimeout(goback, 4000);
 }
 });
@@ -503,6 +542,7 @@ $.getJSON('jo', function(jd) {
 $('#fwv').text((jd.fwv/100>>0)+'.'+(jd.fwv/10%10>>0)+'.'+(jd.fwv%10>>0));
 $('#alm').val(jd.alm).selectmenu('refresh');
 if(jd.aoo>0) $('#aoo').attr('checked',true).checkboxradio('refresh');
+if(jd.cmr>0) $('#cmr').attr('checked',true).checkboxradio('refresh');
 $('#lsz').val(jd.lsz).selectmenu('refresh');
 $('#tsn').val(jd.tsn).selectmenu('refresh');
 $('#mnt').val(jd.mnt).selectmenu('refresh');
@@ -512,8 +552,12 @@ $('#dth').val(jd.dth);
 $('#vth').val(jd.vth);
 $('#riv').val(jd.riv);
 $('#htp').val(jd.htp);
+$('#ddb').val(jd.ddb);
+$('#tdb').val(jd.tdb);
+$('#thb').val(jd.thb);
 $('#cdt').val(jd.cdt);
 $('#dri').val(jd.dri);
+$('#dfw').val(jd.dfw);
 if(jd.sto) $('#to_cap').attr('checked',true).checkboxradio('refresh');
 else $('#to_ignore').attr('checked',true).checkboxradio('refresh');
 $('#ati').val(jd.ati);
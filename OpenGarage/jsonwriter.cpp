@@ -0,0 +1,144 @@
+/* OpenGarage Firmware
+ *
+ * Streaming JSON writer
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "jsonwriter.h"
+
+void JsonWriter::flush() {
+  if(!len) return;
+  buf[len] = 0;
+  if(!res) return;
+  res->writeBodyChunk((char *) "%s", buf);
+  len = 0;
+}
+
+void JsonWriter::put(char c) {
+  if(len == cap) {
+    if(!res) {
+      overflowed = true;
+      return;
+    }
+    flush();
+  }
+  buf[len++] = c;
+}
+
+void JsonWriter::put(const char *s) {
+  while(*s) put(*s++);
+}
+
+void JsonWriter::put_escaped(char c) {
+  static const char hex[] = "0123456789abcdef";
+  switch(c) {
+  case '"':  put('\\'); put('"');  break;
+  case '\\': put('\\'); put('\\'); break;
+  case '\n': put('\\'); put('n');  break;
+  case '\r': put('\\'); put('r');  break;
+  case '\t': put('\\'); put('t');  break;
+  default:
+    if((byte)c < 0x20) {
+      put("\\u00");
+      put(hex[(c>>4)&0x0F]);
+      put(hex[c&0x0F]);
+    } else {
+      put(c);
+    }
+  }
+}
+
+// emit the separator needed before a new member / element
+void JsonWriter::element() {
+  if(after_key) {
+    after_key = false;
+    return;
+  }
+  uint32_t bit = 1UL << depth;
+  if(first & bit) first &= ~bit;
+  else if(depth) put(',');
+}
+
+void JsonWriter::open(char c) {
+  element();
+  put(c);
+  depth++;
+  first |= (1UL << depth);
+}
+
+void JsonWriter::close(char c) {
+  first &= ~(1UL << depth);
+  depth--;
+  put(c);
+}
+
+void JsonWriter::key(const __FlashStringHelper *k) {
+  element();
+  put('"');
+  PGM_P p = reinterpret_cast<PGM_P>(k);
+  char c;
+  while((c = pgm_read_byte(p++)) != 0) put(c);
+  put("\":");
+  after_key = true;
+}
+
+void JsonWriter::key(const char *k) {
+  element();
+  put('"');
+  put(k);
+  put("\":");
+  after_key = true;
+}
+
+void JsonWriter::value(long v) {
+  char tmp[12];
+  element();
+  put(ltoa(v, tmp, 10));
+}
+
+void JsonWriter::value(ulong v) {
+  char tmp[12];
+  element();
+  put(ultoa(v, tmp, 10));
+}
+
+void JsonWriter::value(float v) {
+  char tmp[16];
+  element();
+  if(isnan(v) || isinf(v)) put("null");
+  else put(dtostrf(v, 0, 2, tmp));
+}
+
+void JsonWriter::value(const char *s) {
+  element();
+  put('"');
+  if(s) {
+    while(*s) put_escaped(*s++);
+  }
+  put('"');
+}
+
+void JsonWriter::value(const __FlashStringHelper *s) {
+  element();
+  put('"');
+  PGM_P p = reinterpret_cast<PGM_P>(s);
+  char c;
+  while((c = pgm_read_byte(p++)) != 0) put_escaped(c);
+  put('"');
+}
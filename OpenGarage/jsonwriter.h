@@ -0,0 +1,94 @@
+/* OpenGarage Firmware
+ *
+ * Streaming JSON writer header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JSON_WRITER_H
+#define _JSON_WRITER_H
+
+#include <Arduino.h>
+#include <Response.h>
+
+#include "defines.h"
+
+#define JSON_WRITER_BUF_SIZE  128 // bytes buffered before a body chunk is written
+
+/* Writes JSON straight into OTF response body chunks through a small
+ * fixed buffer, so no heap memory is used to build a response.
+ * It can also write into a caller supplied buffer (for push messages),
+ * in which case output that does not fit is dropped and overflow()
+ * returns true. Commas between members / elements are inserted
+ * automatically. */
+class JsonWriter {
+public:
+  JsonWriter(OTF::Response &res) : res(&res), buf(ibuf), cap(JSON_WRITER_BUF_SIZE), len(0),
+    depth(0), first(0), after_key(false), overflowed(false) {}
+  JsonWriter(char *out, size_t size) : res(NULL), buf(out), cap(size-1), len(0),
+    depth(0), first(0), after_key(false), overflowed(false) { buf[0] = 0; }
+  ~JsonWriter() { flush(); }
+
+  void begin_object() { open('{'); }
+  void end_object()   { close('}'); }
+  void begin_array()  { open('['); }
+  void end_array()    { close(']'); }
+  void key(const __FlashStringHelper *k);
+  void key(const char *k);
+
+  void value(int v)           { value((long)v); }
+  void value(unsigned int v)  { value((ulong)v); }
+  void value(long v);
+  void value(ulong v);
+  void value(float v);
+  void value(bool v)          { element(); put(v ? "true" : "false"); }
+  void value(const char *s);
+  void value(const __FlashStringHelper *s);
+  void value(const String &s) { value(s.c_str()); }
+  // write an already serialized JSON value (e.g. a stringified JSON option)
+  void raw(const char *s)     { element(); put(s); }
+
+  template<typename T>
+  void member(const __FlashStringHelper *k, const T& v) { key(k); value(v); }
+
+  void flush();
+  // for writers on a caller supplied buffer
+  const char *c_str() { buf[len] = 0; return buf; }
+  size_t length() const { return len; }
+  bool overflow() const { return overflowed; }
+
+private:
+  void open(char c);
+  void close(char c);
+  void element();
+  void put(char c);
+  void put(const char *s);
+  void put_escaped(char c);
+
+  OTF::Response *res;
+  char ibuf[JSON_WRITER_BUF_SIZE+1];
+  char *buf;
+  size_t cap;
+  size_t len;
+  byte depth;
+  uint32_t first; // bit n set: nothing has been written yet at nesting level n
+  bool after_key;
+  bool overflowed;
+};
+
+#endif  // _JSON_WRITER_H
@@ -0,0 +1,229 @@
+/* OpenGarage Firmware
+ *
+ * OpenGarage library: log storage
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "OpenGarage.h"
+
+File  OpenGarage::log_file;
+bool  OpenGarage::log_exists = false;
+uint  OpenGarage::log_head = 0;
+uint  OpenGarage::log_count = 0;
+ulong OpenGarage::log_newest = 0;
+ulong OpenGarage::log_seq = 0;
+LogStruct OpenGarage::log_stage[LOG_STAGE_SIZE];
+byte  OpenGarage::log_nstaged = 0;
+ulong OpenGarage::log_stage_time = 0;
+LogStatStruct OpenGarage::log_stats = {0, 0, 0, 0, 0};
+uint  OpenGarage::log_rd_idx = 0;
+uint  OpenGarage::log_rd_left = 0;
+byte  OpenGarage::log_rd_staged = 0;
+
+static const char* log_fname = LOG_FNAME;
+
+/* Load the in-RAM index of the log ring: whether the file exists,
+ * the write head, the number of records and the time stamp of the
+ * newest record. After this the log file header is never read again.
+ * log_seq counts records written since boot; it starts from a random
+ * base so that a /jl cursor handed out before a reboot or log reset
+ * does not match. */
+void OpenGarage::log_setup() {
+  log_exists = false;
+  log_head = 0;
+  log_count = 0;
+  log_newest = 0;
+  log_nstaged = 0;
+  log_seq = ESP.random();
+  File file = SPIFFS.open(log_fname, "r");
+  if(!file) return;
+  log_exists = true;
+  uint curr;
+  if(file.readBytes((char*)&curr, sizeof(curr)) == sizeof(curr) && curr<MAX_LOG_SIZE) {
+    uint lsz = options[OPTION_LSZ].ival;
+    LogStruct l;
+    log_head = curr;
+    // if the slot at the head is in use the ring has wrapped around
+    log_count = curr;
+    if(curr<lsz && file.seek(sizeof(uint)+curr*sizeof(LogStruct), SeekSet) &&
+       file.readBytes((char*)&l, sizeof(LogStruct)) == sizeof(LogStruct) && l.tstamp) {
+      log_count = lsz;
+    }
+    if(log_count>lsz) log_count = lsz;
+    uint last = (((curr<lsz)?curr:lsz)+lsz-1) % lsz;
+    if(file.seek(sizeof(uint)+last*sizeof(LogStruct), SeekSet) &&
+       file.readBytes((char*)&l, sizeof(LogStruct)) == sizeof(LogStruct)) {
+      log_newest = l.tstamp;
+    }
+  }
+  file.close();
+}
+
+void OpenGarage::log_reset() {
+  log_exists = false;
+  log_head = 0;
+  log_count = 0;
+  log_newest = 0;
+  log_nstaged = 0;
+  log_seq = ESP.random();
+  set_dirty_bit(DIRTY_BIT_JL, 1);
+  if(!SPIFFS.remove(log_fname)) {
+    DEBUG_PRINTLN(F("failed to remove log file"));
+    return;
+  }else{DEBUG_PRINTLN(F("Removed log file"));}
+  DEBUG_PRINTLN(F("ok"));  
+}
+
+/* Log records are staged in RAM and written to flash in batches:
+ * when the staging buffer is full, or LOG_FLUSH_INTERVAL ms after
+ * the first staged record (see log_process). If a flush fails the
+ * buffer stays full; the oldest staged record then makes room for
+ * the new one and is counted in log_stats.dropped. */
+void OpenGarage::write_log(const LogStruct& data) {
+  if(log_nstaged>=LOG_STAGE_SIZE) {
+    memmove(log_stage, log_stage+1, (LOG_STAGE_SIZE-1)*sizeof(LogStruct));
+    log_nstaged = LOG_STAGE_SIZE-1;
+    log_stats.dropped++;
+  }
+  if(!log_nstaged) log_stage_time = millis();
+  log_stage[log_nstaged++] = data;
+  log_newest = data.tstamp;
+  log_seq++;
+  log_stats.events++;
+  set_dirty_bit(DIRTY_BIT_JL, 1);
+  if(log_nstaged>=LOG_STAGE_SIZE) log_flush();
+}
+
+void OpenGarage::log_process() {
+  if(log_nstaged && millis()-log_stage_time >= LOG_FLUSH_INTERVAL) log_flush();
+}
+
+void OpenGarage::log_flush() {
+  if(!log_nstaged) return;
+  File file;
+  DEBUG_PRINTLN(F("saving log data..."));  
+  if(!log_exists) {  // create log file
+    file = SPIFFS.open(log_fname, "w");
+    if(!file) {
+      DEBUG_PRINTLN(F("failed"));
+      log_stage_time = millis();  // retry after another LOG_FLUSH_INTERVAL
+      return;
+    }
+    // pre-fill the log file to maximum size
+    uint curr = 0;
+    bool ok = file.write((const byte*)&curr, sizeof(curr)) == sizeof(curr);
+    LogStruct l;
+    memset(&l, 0, sizeof(LogStruct));
+    for(uint i=0;ok && i<MAX_LOG_SIZE;i++) {
+      ok = file.write((const byte*)&l, sizeof(LogStruct)) == sizeof(LogStruct);
+    }
+    file.close();
+    if(!ok) {  // recreated on the next attempt
+      DEBUG_PRINTLN(F("failed"));
+      log_stage_time = millis();
+      return;
+    }
+    log_stats.writes += MAX_LOG_SIZE+1;
+    log_stats.bytes += sizeof(curr)+MAX_LOG_SIZE*sizeof(LogStruct);
+    log_exists = true;
+    log_head = 0;
+    log_count = 0;
+  }
+  file = SPIFFS.open(log_fname, "r+");
+  if(!file) {
+    DEBUG_PRINTLN(F("failed"));
+    log_stage_time = millis();
+    return;
+  }
+  uint lsz = options[OPTION_LSZ].ival;
+  uint head = log_head, count = log_count;
+  bool ok = true;
+  // write staged records in contiguous runs, wrapping at the ring end
+  for(byte i=0;ok && i<log_nstaged;) {
+    byte run = log_nstaged-i;
+    if(head>=lsz) run = 1;
+    else if(run>lsz-head) run = lsz-head;
+    size_t n = run*sizeof(LogStruct);
+    ok = file.seek(sizeof(uint)+head*sizeof(LogStruct), SeekSet) &&
+         file.write((const byte*)(log_stage+i), n) == n;
+    head = (head+run) % lsz;
+    count = (count+run<lsz) ? count+run : lsz;
+    log_stats.writes++;
+    log_stats.bytes += n;
+    i += run;
+  }
+  // the header goes last so an interrupted flush leaves the old head
+  if(ok) {
+    ok = file.seek(0, SeekSet) &&
+         file.write((const byte*)&head, sizeof(head)) == sizeof(head);
+    log_stats.writes++;
+    log_stats.bytes += sizeof(head);
+  }
+  file.close();
+  if(!ok) {  // keep the records staged, the file still holds the old head
+    DEBUG_PRINTLN(F("failed"));
+    log_stage_time = millis();
+    return;
+  }
+  log_head = head;
+  log_count = count;
+  log_stats.flushes++;
+  log_nstaged = 0;
+  DEBUG_PRINTLN(F("ok"));      
+}
+
+/* Log records are read back newest first: staged records come
+ * first, then reading starts at the write head and walks the ring
+ * buffer backwards */
+bool OpenGarage::read_log_start() {
+  if(log_file) log_file.close();
+  log_rd_staged = log_nstaged;
+  log_rd_left = 0;
+  if(log_exists && log_count) {
+    log_file = SPIFFS.open(log_fname, "r");
+    if(log_file) {
+      uint lsz = options[OPTION_LSZ].ival;
+      log_rd_idx = (log_head<lsz) ? log_head : lsz;
+      log_rd_left = log_count;
+    }
+  }
+  return log_rd_staged || log_rd_left;
+}
+
+bool OpenGarage::read_log_next(LogStruct& data) {
+  if(log_rd_staged) {
+    data = log_stage[--log_rd_staged];
+    return true;
+  }
+  if(!log_file || !log_rd_left) return false;
+  uint lsz = options[OPTION_LSZ].ival;
+  log_rd_idx = (log_rd_idx+lsz-1) % lsz;
+  log_rd_left--;
+  if(!log_file.seek(sizeof(uint)+log_rd_idx*sizeof(LogStruct), SeekSet)) return false;
+  if(log_file.readBytes((char*)&data, sizeof(LogStruct)) != sizeof(LogStruct)) return false;
+  return true;  
+}
+
+bool OpenGarage::read_log_end() {
+  log_rd_staged = 0;
+  log_rd_left = 0;
+  if(!log_file) return false;
+  log_file.close();
+  return true;
+}
@@ -24,6 +24,7 @@
 #include <cstring>
 #include <DNSServer.h>
 #include <PubSubClient.h>
+#include <WebSocketsServer.h>
 #include <OpenThingsFramework.h>
 #include <Request.h>
 #include <Response.h>
@@ -31,20 +32,25 @@
 #include "pitches.h"
 #include "OpenGarage.h"
 #include "espconnect.h"
+#include "jsonwriter.h"
+#include "notifier.h"
+#include "outbox.h"
+#include "events.h"
+#include "mqttconn.h"
 
 OpenGarage og;
 OTF::OpenThingsFramework *otf = NULL;
 ESP8266WebServer *updateServer = NULL;
 DNSServer *dns = NULL;
+WebSocketsServer *wsserver = NULL;
 
 static Ticker aux_ticker;
 static Ticker ip_ticker;
 static Ticker restart_ticker;
 
-static WiFiClient wificlient;
-PubSubClient mqttclient(wificlient);
+PubSubClient mqttclient;  // its transport is set by MqttConn
 
-static String scanned_ssids;
+static byte scanned_ssids;  // networks found by the AP mode scan
 static byte read_cnt = 0;
 static uint distance = 0;
 static uint vdistance = 0;
@@ -61,9 +67,63 @@ static byte curr_mode;
 static byte door_status_hist = 0;
 static ulong curr_utc_time = 0;
 static ulong curr_utc_hour= 0;
-static HTTPClient http;
+static int16_t rssi = 0;
+static int otc_status = 0;
+static ulong otc_change = 0;
+// per-boot tag and version counters used to build response ETags
+static ulong etag_boot = 0;
+static ulong etag_version[DIRTY_BIT_JL+1];
+// last values pushed to websocket clients
+static uint push_dist = 0;
+static float push_temp = 0;
+static float push_humid = 0;
+static byte cmd_state = CMD_NONE;
+static byte cmd_target = 0;     // door status requested by the command
+static byte cmd_tries = 0;
+static ulong cmd_time = 0;      // millis() when the command was issued or retried
+static ulong cmd_actuated = 0;  // millis() at the end of the relay click
+static ulong cmd_latency = 0;   // ms from the relay click to the door state change
+static ulong cmd_ok = 0;
+static ulong cmd_fail = 0;
+static uint cmd_hist[CMD_HIST_BUCKETS];
+static bool wifi_fast = false;     // connecting with the cached BSSID and lease
+static ulong wifi_fast_timeout = 0;
+static ulong wifi_lease_end = 0;   // millis() when a reused cached lease is due, 0 if DHCP holds the lease
+static ulong wifi_cache_time = 0;  // millis() when the WiFi cache was last saved
+static WiFiEventHandler wifi_assoc_handler;
+static WiFiEventHandler wifi_dhcp_handler;
+// millis() at each boot stage, 0 until reached
+static ulong boot_begin = 0;
+static ulong boot_options = 0;
+static ulong boot_sensors = 0;
+static ulong boot_assoc = 0;
+static ulong boot_dhcp = 0;
+static ulong boot_first_jc = 0;
+// WiFi outages, the device keeps running while it re-associates
+static ulong wifi_lost_ms = 0;     // millis() when the connection was lost, 0 if connected
+static ulong wifi_retry_ms = 0;    // next association attempt
+static ulong wifi_backoff = 0;
+static ulong wifi_outages = 0;
+static ulong wifi_outage_last = 0; // ms
+static ulong wifi_outage_max = 0;
+static ulong wifi_outage_total = 0;
+static uint64_t reconfig_pending = 0;  // OPTION_BIT()s of options changed at run time
+static ulong checkstatus_timeout = 0;
+static ulong temp_tstamp = 0;      // time of the last valid temperature reading, 0 if none
+static ulong humid_tstamp = 0;
+static bool tele_force = true;     // send telemetry regardless of deadbands
+static ulong tele_time = 0;        // millis() of the last telemetry message
+static byte tele_door = 0;
+static byte tele_vehicle = 0;
+static uint tele_dist = 0;
+static float tele_temp = 0;
+static float tele_humid = 0;
+static int16_t tele_rssi = 0;
 
 void do_setup();
+void otf_begin();
+void publish_door_state();
+uint32_t wifi_lease_left();
 
 void otf_send_html_P(OTF::Response &res, const __FlashStringHelper *content) {
   res.writeStatus(200, "OK");
@@ -74,22 +134,45 @@ void otf_send_html_P(OTF::Response &res, const __FlashStringHelper *content) {
   DEBUG_PRINTLN(F(" bytes sent."));
 }
 
-void otf_send_json(OTF::Response &res, String json) {
+void otf_send_json_header(OTF::Response &res, const char *etag = NULL) {
   res.writeStatus(200, "OK");
   res.writeHeader(F("content-type"), F("application/json"));
   res.writeHeader(F("access-control-allow-origin"), (char *) "*"); // from esp8266 2.4 this has to be sent explicitly
-  res.writeBodyChunk((char *) "%s",json.c_str());
+  if(etag) {
+    res.writeHeader(F("cache-control"), F("no-cache"));
+    res.writeHeader(F("etag"), (char *) "%s", etag);
+  }
+}
+
+/* Build the ETag of a cached resource from its dirty bit: each time
+ * the bit is found set, the resource version is bumped and the bit
+ * cleared. If the request's If-None-Match carries the same tag,
+ * answer 304 Not Modified and return true. */
+bool otf_check_etag(const OTF::Request &req, OTF::Response &res, byte bit, char *etag, size_t size, uint32_t query=0) {
+  if(og.get_dirty_bit(bit)) {
+    etag_version[bit]++;
+    og.set_dirty_bit(bit, 0);
+  }
+  // query is a hash of the parameters that change the response, if any
+  if(query) snprintf(etag, size, "\"%lx-%u-%lx-%lx\"", etag_boot, bit, etag_version[bit], (ulong)query);
+  else snprintf(etag, size, "\"%lx-%u-%lx\"", etag_boot, bit, etag_version[bit]);
+  const char *inm = req.getHeader("If-None-Match");
+  if(inm && strstr(inm, etag)) {
+    res.writeStatus(304, "Not Modified");
+    res.writeHeader(F("etag"), (char *) "%s", etag);
+    res.writeHeader(F("access-control-allow-origin"), (char *) "*");
+    return true;
+  }
+  return false;
 }
 
 void otf_send_result(OTF::Response &res, byte code, const char *item = NULL) {
-  String json = F("{\"result\":");
-  json += code;
-  if (!item) item = "";
-  json += F(",\"item\":\"");
-  json += item;
-  json += F("\"");
-  json += F("}");
-  otf_send_json(res, json);
+  otf_send_json_header(res);
+  JsonWriter w(res);
+  w.begin_object();
+  w.member(F("result"), code);
+  w.member(F("item"), item ? item : "");
+  w.end_object();
 }
 
 void updateserver_send_result(byte code, const char* item = NULL) {
@@ -146,6 +229,8 @@ void report_ip() {
 
 void restart_in(uint32_t ms) {
   if(og.state != OG_STATE_WAIT_RESTART) {
+    og.log_flush();
+    og.options_flush();
     og.state = OG_STATE_WAIT_RESTART;
     DEBUG_PRINTLN(F("Prepare to restart..."));
     restart_ticker.once_ms(ms, og.restart);
@@ -174,17 +259,22 @@ char dec2hexchar(byte dec) {
   else return 'A'+(dec-10);
 }
 
-String get_mac() {
-  static String hex = "";
-  if(!hex.length()) {
+// format 6 address bytes as XX:XX:XX:XX:XX:XX into buf (at least 18 bytes)
+void mac2str(const byte *mac, char *buf) {
+  for(byte i=0;i<6;i++) {
+    *buf++ = dec2hexchar((mac[i]>>4)&0x0F);
+    *buf++ = dec2hexchar(mac[i]&0x0F);
+    if(i!=5) *buf++ = ':';
+  }
+  *buf = 0;
+}
+
+const char* get_mac() {
+  static char hex[18] = {0};
+  if(!hex[0]) {
     byte mac[6];
     WiFi.macAddress(mac);
-
-    for(byte i=0;i<6;i++) {
-      hex += dec2hexchar((mac[i]>>4)&0x0F);
-      hex += dec2hexchar(mac[i]&0x0F);
-      if(i!=5) hex += ":";
-    }
+    mac2str(mac, hex);
   }
   return hex;
 }
@@ -216,105 +306,310 @@ String get_ip() {
   return ip;
 }
 
-void sta_controller_fill_json(String& json) {
-  json = "";
-  json += F("{\"dist\":");
-  json += distance;
-  json += F(",\"door\":");
-  json += door_status;
-  json += F(",\"vehicle\":");
-  json += vehicle_status;
-  json += F(",\"rcnt\":");
-  json += read_cnt;
-  json += F(",\"fwv\":");
-  json += og.options[OPTION_FWV].ival;
-  json += F(",\"name\":\"");
-  json += og.options[OPTION_NAME].sval;
-  json += F("\",\"mac\":\"");
-  json += get_mac();
-  json += F("\",\"cid\":");
-  json += ESP.getChipId();
-  json += F(",\"rssi\":");
-  json += (int16_t)WiFi.RSSI();
+const __FlashStringHelper* cmd_state_name() {
+  switch(cmd_state) {
+  case CMD_PENDING:   return F("pending");
+  case CMD_MOVING:    return F("moving");
+  case CMD_COMPLETED: return F("completed");
+  case CMD_FAILED:    return F("failed");
+  default:            return F("none");
+  }
+}
+
+void command_fill_json(JsonWriter& w) {
+  w.begin_object();
+  w.member(F("state"), cmd_state_name());
+  w.member(F("target"), cmd_target);
+  w.member(F("tries"), cmd_tries);
+  w.member(F("lat"), cmd_latency);
+  w.member(F("ok"), cmd_ok);
+  w.member(F("fail"), cmd_fail);
+  w.key(F("hist"));
+  w.begin_array();
+  for(byte i=0;i<CMD_HIST_BUCKETS;i++) w.value(cmd_hist[i]);
+  w.end_array();
+  w.end_object();
+}
+
+void sta_controller_fill_json(JsonWriter& w) {
+  w.begin_object();
+  w.member(F("dist"), distance);
+  w.member(F("door"), door_status);
+  w.member(F("vehicle"), vehicle_status);
+  w.member(F("rcnt"), read_cnt);
+  w.member(F("fwv"), og.options[OPTION_FWV].ival);
+  w.member(F("name"), og.options[OPTION_NAME].sval.c_str());
+  w.member(F("mac"), get_mac());
+  w.member(F("cid"), ESP.getChipId());
+  w.member(F("rssi"), rssi);
   if(og.options[OPTION_TSN].ival) {
-  	json += F(",\"temp\":");
-  	json += tempC;
-  	json += F(",\"humid\":");
-  	json += humid;
-  }
-  json += F(",\"otcs\":");
-  json += otf->getCloudStatus();
-  json += F(",\"otcc\":");
-  json += curr_utc_time - otf->getTimeSinceLastCloudStatusChange() / 1000;
-  json += F("}");
+    w.member(F("temp"), tempC);
+    w.member(F("humid"), humid);
+    w.member(F("tts"), temp_tstamp);
+    w.member(F("hts"), humid_tstamp);
+  }
+  w.member(F("otcs"), otc_status);
+  w.member(F("otcc"), otc_change);
+  w.key(F("cmd"));
+  command_fill_json(w);
+  w.end_object();
 }
 
 void on_sta_controller(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_AP) return;
-  String json;
-  sta_controller_fill_json(json);
-  otf_send_json(res, json);
+  char etag[32];
+  if(otf_check_etag(req, res, DIRTY_BIT_JC, etag, sizeof(etag))) return;
+  otf_send_json_header(res, etag);
+  JsonWriter w(res);
+  sta_controller_fill_json(w);
+  if(!boot_first_jc) boot_first_jc = millis();
+}
+
+void on_ws_event(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
+  if(type == WStype_CONNECTED) {
+    // a new client gets the full status, later messages are deltas
+    char buf[512];
+    JsonWriter w(buf, sizeof(buf));
+    sta_controller_fill_json(w);
+    if(!w.overflow()) wsserver->sendTXT(num, w.c_str(), w.length());
+  }
+}
+
+/* Push a compact status delta to websocket clients when the door
+ * just opened or closed, or when distance or temperature / humidity
+ * moved past their deadband since the last push */
+void push_status(byte event) {
+  if(!wsserver || !wsserver->connectedClients()) return;
+  bool door_changed = (event == DOOR_STATUS_JUST_OPENED || event == DOOR_STATUS_JUST_CLOSED);
+  bool dist_changed = abs((int)distance-(int)push_dist) >= (int)og.options[OPTION_DDB].ival;
+  float tdb = og.options[OPTION_TDB].ival / 10.0f;
+  bool th_changed = og.options[OPTION_TSN].ival &&
+                    (fabs(tempC-push_temp) >= tdb || fabs(humid-push_humid) >= tdb);
+  if(!door_changed && !dist_changed && !th_changed) return;
+
+  char buf[128];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object();
+  w.member(F("door"), door_status);
+  w.member(F("vehicle"), vehicle_status);
+  w.member(F("rcnt"), read_cnt);
+  if(door_changed || dist_changed) {
+    w.member(F("dist"), distance);
+    push_dist = distance;
+  }
+  if(th_changed) {
+    w.member(F("temp"), tempC);
+    w.member(F("humid"), humid);
+    push_temp = tempC;
+    push_humid = humid;
+  }
+  w.end_object();
+  wsserver->broadcastTXT(w.c_str(), w.length());
+}
+
+/* MQTT telemetry: all readings in one retained JSON message on
+ * <topic>/OUT/JSON. It is sent when the door or vehicle status changes,
+ * when a reading moved past its deadband (ddb, tdb, MQTT_RSSI_DB) since
+ * the last message, or when the thb heartbeat expires. */
+void publish_telemetry() {
+  const MqttStruct& mqtt_config = og.get_mqtt_config();
+  if((mqtt_config.domain.length()<=8) || !mqttclient.connected()) return;
+  ulong thb = og.options[OPTION_THB].ival;
+  float tdb = og.options[OPTION_TDB].ival / 10.0f;
+  bool th = og.options[OPTION_TSN].ival;
+  if(!tele_force &&
+     door_status == tele_door && vehicle_status == tele_vehicle &&
+     abs((int)distance-(int)tele_dist) < (int)og.options[OPTION_DDB].ival &&
+     (!th || (fabs(tempC-tele_temp) < tdb && fabs(humid-tele_humid) < tdb)) &&
+     abs(rssi-tele_rssi) < MQTT_RSSI_DB &&
+     (!thb || millis()-tele_time < thb*1000)) return;
+
+  char buf[128];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object();
+  w.member(F("door"), door_status);
+  w.member(F("vehicle"), vehicle_status);
+  w.member(F("dist"), distance);
+  if(th) {
+    w.member(F("temp"), tempC);
+    w.member(F("humid"), humid);
+  }
+  w.member(F("rssi"), rssi);
+  w.end_object();
+  if(w.overflow() || !mqttclient.publish(mqtt_config.topic_json.c_str(), w.c_str(), true)) return;
+  tele_force = false;
+  tele_time = millis();
+  tele_door = door_status;
+  tele_vehicle = vehicle_status;
+  tele_dist = distance;
+  tele_temp = tempC;
+  tele_humid = humid;
+  tele_rssi = rssi;
 }
 
 void on_sta_debug(const OTF::Request &req, OTF::Response &res) {
-  String json = "";
-  json += F("{");
-  json += F("\"rcnt\":");
-  json += read_cnt;
-  json += F(",\"fwv\":");
-  json += og.options[OPTION_FWV].ival;
-  json += F(",\"name\":\"");
-  json += og.options[OPTION_NAME].sval;
-  json += F("\",\"mac\":\"");
-  json += get_mac();
-  json += F("\",\"cid\":");
-  json += ESP.getChipId();
-  json += F(",\"rssi\":");
-  json += (int16_t)WiFi.RSSI();
-  json += F(",\"bssid\":\"");
-  json += WiFi.BSSIDstr();
-  json += F("\",\"build\":\"");
-  json += (F(__DATE__));
-  json += F("\",\"Freeheap\":");
-  json += (uint16_t)ESP.getFreeHeap();
-  json += F("}");
-  otf_send_json(res, json);
-}
-
-void sta_logs_fill_json(String& json, OTF::Response &res) {
-  json = "";
-  json += F("{\"name\":\"");
-  json += og.options[OPTION_NAME].sval;
-  json += F("\",\"time\":");
-  json += curr_utc_time;
-  json += F(",\"logs\":[");
-  if(!og.read_log_start()) {
-    json += F("]}");
-    otf_send_json(res, json);
-    return;
+  char bssid[18];
+  mac2str(WiFi.BSSID(), bssid);
+  otf_send_json_header(res);
+  JsonWriter w(res);
+  w.begin_object();
+  w.member(F("rcnt"), read_cnt);
+  w.member(F("fwv"), og.options[OPTION_FWV].ival);
+  w.member(F("name"), og.options[OPTION_NAME].sval.c_str());
+  w.member(F("mac"), get_mac());
+  w.member(F("cid"), ESP.getChipId());
+  w.member(F("rssi"), (int16_t)WiFi.RSSI());
+  w.member(F("bssid"), bssid);
+  w.member(F("build"), F(__DATE__));
+  w.member(F("Freeheap"), (uint16_t)ESP.getFreeHeap());
+  w.member(F("maxblock"), (uint16_t)ESP.getMaxFreeBlockSize());
+  const LogStatStruct& ls = og.get_log_stats();
+  w.key(F("log"));
+  w.begin_object();
+  w.member(F("events"), ls.events);
+  w.member(F("flushes"), ls.flushes);
+  w.member(F("writes"), ls.writes);
+  w.member(F("bytes"), ls.bytes);
+  w.member(F("dropped"), ls.dropped);
+  w.end_object();
+  const RelayPulseStruct& rp = og.get_relay_pulse();
+  w.key(F("relay"));
+  w.begin_object();
+  w.member(F("queued"), og.get_relay_queued());
+  w.member(F("start"), rp.start);
+  w.member(F("end"), rp.end);
+  w.member(F("now"), millis());
+  w.end_object();
+  w.key(F("mqtt"));
+  w.begin_object();
+  w.member(F("connected"), mqttclient.connected());
+  w.member(F("fails"), MqttConn::get_fails());
+  w.member(F("backoff"), MqttConn::get_backoff());
+  w.member(F("tls"), og.get_mqtt_config().tls);
+  w.member(F("insecure"), og.get_mqtt_config().tls && !og.get_mqtt_config().fingerprint.length());
+  w.member(F("tls_rx"), MqttConn::get_tls_rx());
+  w.member(F("connect_ms"), MqttConn::get_connect_ms());
+  w.member(F("outbox"), Outbox::size());
+  w.member(F("dropped"), Outbox::get_dropped());
+  w.end_object();
+  w.key(F("wifi"));
+  w.begin_object();
+  w.member(F("outages"), wifi_outages);
+  w.member(F("last_ms"), wifi_outage_last);
+  w.member(F("max_ms"), wifi_outage_max);
+  w.member(F("total_ms"), wifi_outage_total);
+  w.member(F("down_ms"), wifi_lost_ms ? millis()-wifi_lost_ms : 0);
+  w.end_object();
+  w.key(F("boot"));
+  w.begin_object();
+  w.member(F("begin"), boot_begin);
+  w.member(F("options"), boot_options);
+  w.member(F("sensors"), boot_sensors);
+  w.member(F("assoc"), boot_assoc);
+  w.member(F("dhcp"), boot_dhcp);
+  w.member(F("first_jc"), boot_first_jc);
+  w.member(F("fast"), wifi_fast);
+  w.member(F("lease"), wifi_lease_left());
+  w.end_object();
+  w.key(F("notify"));
+  w.begin_object();
+  w.member(F("queued"), Notifier::get_queued());
+  w.member(F("coalesced"), Notifier::get_coalesced());
+  w.member(F("overflows"), Notifier::get_overflows());
+  for(byte sink=0;sink<NUM_NOTIFY_SINKS;sink++) {
+    const NotifyStatStruct& ns = Notifier::get_stats(sink);
+    w.key(sink==NOTIFY_SINK_IFTTT ? F("ifttt") : F("mqtt"));
+    w.begin_object();
+    w.member(F("sent"), ns.sent);
+    w.member(F("failed"), ns.failed);
+    w.member(F("retries"), ns.retries);
+    w.member(F("last_ms"), ns.last_ms);
+    w.member(F("max_ms"), ns.max_ms);
+    w.member(F("avg_ms"), ns.sent ? ns.total_ms/ns.sent : 0);
+    w.end_object();
   }
-  LogStruct l;
-  for(uint i=0;i<og.options[OPTION_LSZ].ival;i++) {
-    if(!og.read_log_next(l)) break;
-    if(!l.tstamp) continue;
-    json += F("[");
-    json += l.tstamp;
-    json += F(",");
-    json += l.status;
-    json += F(",");
-    json += l.dist;
-    json += F("],");
+  w.end_object();
+  // latest raw distance samples: [micros, echo us, flags]
+  DistanceSample samples[UD_RING_SIZE];
+  byte n = og.get_distance_samples(samples, UD_RING_SIZE);
+  w.key(F("ud"));
+  w.begin_array();
+  for(byte i=0;i<n;i++) {
+    w.begin_array();
+    w.value(samples[i].ts);
+    w.value(samples[i].echo);
+    w.value(samples[i].flags);
+    w.end_array();
   }
-  og.read_log_end();
-  json.remove(json.length()-1); // remove the extra ,
-  json += F("]}");
+  w.end_array();
+  w.end_object();
+}
+
+/* Records are streamed newest first. The client can ask for only
+ * the records it has not seen yet, either with ?since=<tstamp> or
+ * with the opaque ?cursor=<seq> returned by a previous /jl. When the
+ * cursor is still valid the response is marked "inc":1, otherwise the
+ * whole log is returned. ?limit=N caps the number of records, "lsz"
+ * tells an incremental client how many records to keep. */
+void sta_logs_fill_json(JsonWriter& w, ulong since, ulong limit, const char *cursor) {
+  ulong seq = og.get_log_seq();
+  uint lsz = og.options[OPTION_LSZ].ival;
+  bool inc = false;
+  if(cursor) {
+    ulong nnew = seq - strtoul(cursor, NULL, 10);
+    if(nnew <= lsz) {
+      inc = true;
+      if(nnew < limit) limit = nnew;
+    }
+  }
+  if(since >= og.get_log_newest()) limit = 0;  // nothing newer, answer from the index
+  w.begin_object();
+  w.member(F("name"), og.options[OPTION_NAME].sval.c_str());
+  w.member(F("time"), curr_utc_time);
+  w.member(F("seq"), seq);
+  w.member(F("inc"), inc?1:0);
+  w.member(F("lsz"), lsz);
+  w.key(F("logs"));
+  w.begin_array();
+  if(limit && og.read_log_start()) {
+    LogStruct l;
+    for(uint i=0;i<lsz && limit;i++) {
+      if(!og.read_log_next(l)) break;
+      if(!l.tstamp) continue;
+      if(l.tstamp <= since) break;
+      w.begin_array();
+      w.value(l.tstamp);
+      w.value(l.status);
+      w.value(l.dist);
+      w.end_array();
+      limit--;
+    }
+    og.read_log_end();
+  }
+  w.end_array();
+  w.end_object();
 }
 
 void on_sta_logs(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_AP) return;
-  String json;
-  sta_logs_fill_json(json, res);
-  otf_send_json(res, json);
+  const char *since = req.getQueryParameter("since");
+  const char *limit = req.getQueryParameter("limit");
+  const char *cursor = req.getQueryParameter("cursor");
+  // the same log gives different responses for different queries
+  const char *params[] = {since, limit, cursor};
+  uint32_t query = 0;
+  for(byte i=0;i<3;i++) {
+    if(params[i]) query = og.crc32(params[i], strlen(params[i])+1, query);
+    else query = og.crc32("\xff", 1, query);
+  }
+  char etag[32];
+  if(otf_check_etag(req, res, DIRTY_BIT_JL, etag, sizeof(etag), query)) return;
+  otf_send_json_header(res, etag);
+  JsonWriter w(res);
+  sta_logs_fill_json(w,
+                     since ? strtoul(since, NULL, 10) : 0,
+                     limit ? strtoul(limit, NULL, 10) : MAX_LOG_SIZE,
+                     cursor);
 }
 
 bool verify_device_key(const OTF::Request &req) {
@@ -346,6 +641,81 @@ void on_clear_log(const OTF::Request &req, OTF::Response &res) {
   otf_send_result(res, HTML_SUCCESS, nullptr);
 }
 
+// click the relay, or sound the alarm first if it is enabled
+void door_action() {
+  if(!og.options[OPTION_ALM].ival) {
+    // if alarm is not enabled, trigger relay right away
+    og.click_relay();
+  } else if(og.options[OPTION_AOO].ival && !door_status) {
+    // if 'Do not alarm on open' is on, and door is about to be open, no alarm needed
+    og.click_relay();
+  } else {
+    // else, set alarm
+    og.set_alarm();
+  }
+}
+
+// report a command state change over /jc and MQTT
+void command_update(byte state) {
+  cmd_state = state;
+  og.set_dirty_bit(DIRTY_BIT_JC, 1);
+  const MqttStruct& mqtt_config = og.get_mqtt_config();
+  if((mqtt_config.domain.length()>8) && (mqttclient.connected())) {
+    char buf[160];
+    JsonWriter w(buf, sizeof(buf));
+    command_fill_json(w);
+    if(!w.overflow()) mqttclient.publish(mqtt_config.topic_command.c_str(), w.c_str());
+  }
+}
+
+// start a door command, target is the door status it should end in
+void door_command(byte target) {
+  cmd_target = target;
+  cmd_tries = 1;
+  cmd_time = millis();
+  cmd_latency = 0;
+  door_action();
+  command_update(CMD_PENDING);
+}
+
+/* Follow the current door command: once the relay has been clicked,
+ * wait for the debounced door status to reach the target. If it does
+ * not within CMD_TIMEOUT the command fails, or is retried once if the
+ * cmr option is set. */
+void check_command() {
+  if(cmd_state == CMD_PENDING) {
+    const RelayPulseStruct& rp = og.get_relay_pulse();
+    if(rp.end && (long)(rp.start-cmd_time) >= 0) {
+      cmd_actuated = rp.end;
+      command_update(CMD_MOVING);
+    } else if(millis()-cmd_time > CMD_TIMEOUT) {
+      // the alarm was cancelled or the relay queue was full
+      cmd_fail++;
+      command_update(CMD_FAILED);
+    }
+  } else if(cmd_state == CMD_MOVING) {
+    if(door_status == cmd_target) {
+      cmd_latency = millis()-cmd_actuated;
+      byte b=0;
+      for(ulong t=cmd_latency/1000; t && b<CMD_HIST_BUCKETS-1; t>>=1) b++;
+      cmd_hist[b]++;
+      cmd_ok++;
+      command_update(CMD_COMPLETED);
+    } else if(millis()-cmd_actuated > CMD_TIMEOUT) {
+      if(og.options[OPTION_CMR].ival && cmd_tries<2) {
+        DEBUG_PRINTLN(F("Door did not move, retry command"));
+        cmd_tries++;
+        cmd_time = millis();
+        door_action();  // sounds the alarm again if it is enabled
+        command_update(CMD_PENDING);
+      } else {
+        cmd_fail++;
+        command_update(CMD_FAILED);
+      }
+    }
+  }
+}
+
 void sta_change_controller_main(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_AP) return;
 
@@ -366,16 +736,7 @@ void sta_change_controller_main(const OTF::Request &req, OTF::Response &res) {
         (open && !door_status) ||
         (click)) {
       DEBUG_PRINTLN(F("Valid command recieved based on door status"));
-      if(!og.options[OPTION_ALM].ival) {
-        // if alarm is not enabled, trigger relay right away
-        og.click_relay();
-      } else if(og.options[OPTION_AOO].ival && !door_status) {
-      	// if 'Do not alarm on open' is on, and door is about to be open, no alarm needed
-      	og.click_relay();
-      } else {
-        // else, set alarm
-        og.set_alarm();
-      }
+      door_command(click ? 1-door_status : (open ? 1 : 0));
     }else{
       DEBUG_PRINTLN(F("Command request not valid, door already in requested state"));
     }
@@ -396,6 +757,18 @@ void on_sta_change_controller(const OTF::Request &req, OTF::Response &res) {
   sta_change_controller_main(req, res);
 }
 
+// options that cannot be changed through /co or MQTT
+bool option_locked(byte i) {
+  return og.option_flags(i) & OPTION_FLAG_LOCKED;
+}
+
+// check an integer option value against its limits
+bool option_in_range(byte i, uint ival) {
+  OptionInfo info;
+  og.option_info(i, info);
+  return ival>=info.min && ival<=info.max;
+}
+
 void sta_change_options_main(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_AP) return;
 
@@ -404,86 +777,46 @@ void sta_change_options_main(const OTF::Request &req, OTF::Response &res) {
     return;
   }
 
+  // one pass over the option table: every parameter is looked up
+  // once, checked and staged, nothing is changed unless all are valid
+  const char *svals[NUM_OPTIONS];
+  uint ivals[NUM_OPTIONS];
+  char key[OPTION_NAME_SIZE+1];
   byte i;
-  OptionStruct *o = og.options;
-  
-  byte usi = 0;
-  // FIRST ROUND: check option validity
-  // do not save option values yet
-  for(i=0;i<NUM_OPTIONS;i++,o++) {
-    const char *key = o->name.c_str();
+  for(i=0;i<NUM_OPTIONS;i++) {
+    svals[i] = NULL;
     // these options cannot be modified here
-    if(i==OPTION_FWV || i==OPTION_MOD  || i==OPTION_SSID ||
-      i==OPTION_PASS || i==OPTION_DKEY)
+    if(option_locked(i))
       continue;
-    
-    if(o->max) {  // integer options
-      char *sval = req.getQueryParameter(key);
-      if(sval != NULL) {
-        uint ival = String(sval).toInt();
-        if(ival>o->max) {	// check max limit
-          otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
-          return;
-        }
-        // check min limit
-        if(i==OPTION_DRI && ival < 50) {
-          otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
-        	return;
-        }
-        if(i==OPTION_LSZ && ival < 20) {
-          // minimal log size is 20
-          otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
-          return;
-        }
-        if(i==OPTION_CDT && ival < 50) {
-          // click delay time should be at least 50 ms
-          otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
-          return;
-        }
-        if(i==OPTION_USI && ival==1) {
-          // mark device IP and gateway IP change
-          usi = 1;
-        }
+    strncpy_P(key, (PGM_P)og.option_name(i), sizeof(key));
+    svals[i] = req.getQueryParameter(key);
+    if(svals[i] == NULL) continue;
+    if(og.option_max(i)) {  // integer options
+      ivals[i] = (uint)atol(svals[i]);
+      if(!option_in_range(i, ivals[i])) {
+        otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
+        return;
       }
+    } else if(og.option_flags(i) & OPTION_FLAG_IP) {
+      if(!og.parse_ip_option(svals[i], ivals[i])) {
+        otf_send_result(res, HTML_DATA_FORMATERROR, key);
+        return;
+      }
+    } else if(strlen(svals[i]) > og.options[i].sval.capacity()) {
+      otf_send_result(res, HTML_DATA_OUTOFBOUND, key);
+      return;
     }
   }
-  
-  // Check device IP and gateway IP changes
-  const char* _dvip = "dvip";
-  const char* _gwip = "gwip";
-  const char* _subn = "subn";
-  const char* _dns1 = "dns1";
-
-  String dvip = req.getQueryParameter(_dvip);
-  String gwip = req.getQueryParameter(_gwip);
-  String subn = req.getQueryParameter(_subn);
-  String dns1 = req.getQueryParameter(_dns1);
-
-  if(usi) {
-    if(dvip != NULL) {
-      if(gwip != NULL) {
-        // check validity of IP address
-        IPAddress ip;
-        if(!ip.fromString(dvip)) { otf_send_result(res, HTML_DATA_FORMATERROR, _dvip); return;}
-        if(!ip.fromString(gwip)) { otf_send_result(res, HTML_DATA_FORMATERROR, _gwip); return;}
-        if(subn != NULL) {
-          if(!ip.fromString(subn)) {
-            otf_send_result(res, HTML_DATA_FORMATERROR, _subn);
-            return;
-          }
-        }
-        if(dns1 != NULL) {
-        	if(!ip.fromString(dns1)) {
-            otf_send_result(res, HTML_DATA_FORMATERROR, _dns1);
-            return;
-        	}
-        }
-      } else {
-        otf_send_result(res, HTML_DATA_MISSING, _gwip);
-        return;
-      }              
-    } else {
-      otf_send_result(res, HTML_DATA_MISSING, _dvip);
+
+  // Check device IP and gateway IP changes, their format was
+  // checked above
+  if(svals[OPTION_USI] != NULL && ivals[OPTION_USI]==1) {
+    if(svals[OPTION_DVIP] == NULL || !ivals[OPTION_DVIP]) {
+      otf_send_result(res, HTML_DATA_MISSING, "dvip");
+      return;
+    }
+    if(svals[OPTION_GWIP] == NULL || !ivals[OPTION_GWIP]) {
+      otf_send_result(res, HTML_DATA_MISSING, "gwip");
       return;
     }
   }
@@ -495,6 +828,10 @@ void sta_change_options_main(const OTF::Request &req, OTF::Response &res) {
   String ckey = req.getQueryParameter(_ckey);
 
   if(nkey != NULL) {
+    if(nkey.length() > og.options[OPTION_DKEY].sval.capacity()) {
+      otf_send_result(res, HTML_DATA_OUTOFBOUND, _nkey);
+      return;
+    }
     if(ckey != NULL) {
       if(!nkey.equals(ckey)) {
         otf_send_result(res, HTML_MISMATCH, _ckey);
@@ -506,34 +843,17 @@ void sta_change_options_main(const OTF::Request &req, OTF::Response &res) {
     }
   }
   
-  // SECOND ROUND: change option values
-  o = og.options;
-  for(i=0;i<NUM_OPTIONS;i++,o++) {
-    const char *key = o->name.c_str();
-    // these options cannot be modified here
-    if(i==OPTION_FWV || i==OPTION_MOD  || i==OPTION_SSID ||
-      i==OPTION_PASS || i==OPTION_DKEY)
-      continue;
-
-    char *sval = req.getQueryParameter(key);
-    if(sval != NULL) {
-      if (o->max) {  // integer options
-        uint ival = String(sval).toInt();
-        o->ival = ival;
-      } else {
-        o->sval = String(sval);
-      }
-    }
-  }
-
-  if(usi) {
-    og.options[OPTION_DVIP].sval = dvip;
-    og.options[OPTION_GWIP].sval = gwip;
-    if(subn != NULL) {
-      og.options[OPTION_SUBN].sval = subn;
-    }
-    if(dns1 != NULL) {
-    	og.options[OPTION_DNS1].sval = dns1;
+  // change the staged option values, this includes the static IP
+  // options when usi is set
+  for(i=0;i<NUM_OPTIONS;i++) {
+    if(svals[i] == NULL) continue;
+    OptionStruct& o = og.options[i];
+    if(og.option_max(i) || (og.option_flags(i) & OPTION_FLAG_IP)) {  // integer options
+      if(o.ival != ivals[i]) reconfig_pending |= OPTION_BIT(i);
+      o.ival = ivals[i];
+    } else {
+      if(strcmp(o.sval.c_str(), svals[i])) reconfig_pending |= OPTION_BIT(i);
+      o.sval = svals[i];
     }
   }
   
@@ -549,50 +869,52 @@ void on_sta_change_options(const OTF::Request &req, OTF::Response &res) {
   sta_change_options_main(req, res);
 }
 
-void sta_options_fill_json(String& json) {
-  json = "{";
+void sta_options_fill_json(JsonWriter& w) {
+  w.begin_object();
   OptionStruct *o = og.options;
   for(byte i=0;i<NUM_OPTIONS;i++,o++) {
-    if(!o->max) {
-      if(i==OPTION_PASS || i==OPTION_DKEY) { // do not output password or device key
-        continue;
-      } else if(i==OPTION_MQTT || i==OPTION_IFTT || i==OPTION_OTF) {
-        json += F("\"");
-        json += o->name;
-        json += F("\":");
-        json += o->sval;
-        json += ",";
-      } else {
-        json += F("\"");
-        json += o->name;
-        json += F("\":");
-        json += F("\"");
-        json += o->sval;
-        json += F("\"");
-        json += ",";
-      }
-    } else {  // if this is a int option
-      json += F("\"");
-      json += o->name;
-      json += F("\":");
-      json += o->ival;
-      json += ",";
+    byte flags = og.option_flags(i);
+    if(flags & OPTION_FLAG_SECRET) continue;  // do not output password or device key
+    w.key(og.option_name(i));
+    if(og.option_max(i)) {  // if this is a int option
+      w.value(o->ival);
+    } else if(flags & OPTION_FLAG_IP) {
+      if(o->ival) w.value(IPAddress(o->ival).toString());
+      else w.value(F("-.-.-.-"));
+    } else if(flags & OPTION_FLAG_JSON) {
+      w.raw(o->sval.c_str());
+    } else {
+      w.value(o->sval.c_str());
     }
   }
-  json.remove(json.length()-1); // remove the extra ,
-  json += F("}");
+  w.end_object();
 }
 
 void on_sta_options(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_AP) return;
-  String json;
-  sta_options_fill_json(json);
-  otf_send_json(res, json);
+  char etag[32];
+  if(otf_check_etag(req, res, DIRTY_BIT_JO, etag, sizeof(etag))) return;
+  otf_send_json_header(res, etag);
+  JsonWriter w(res);
+  sta_options_fill_json(w);
 }
 
 void on_ap_scan(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_STA) return;
-  otf_send_json(res, scanned_ssids);
+  otf_send_json_header(res);
+  JsonWriter w(res);
+  // old format of the wireless network JSON, kept for the mobile app
+  w.begin_object();
+  w.key(F("ssids"));
+  w.begin_array();
+  for(byte i=0;i<scanned_ssids;i++) w.value(WiFi.SSID(i));
+  w.end_array();
+  w.key(F("rssis"));
+  w.begin_array();
+  char rssi[12];
+  for(byte i=0;i<scanned_ssids;i++) w.value(ltoa(WiFi.RSSI(i), rssi, 10));
+  w.end_array();
+  w.end_object();
 }
 
 void on_ap_change_config(const OTF::Request &req, OTF::Response &res) {
@@ -604,13 +926,15 @@ void on_ap_change_config(const OTF::Request &req, OTF::Response &res) {
     // if cloud token is provided, save it
     char *auth = req.getQueryParameter("auth");
     if(auth!=NULL&&strlen(auth)!=0) {
-      OTFStruct otf_config = og.get_otf_config();
-      StaticJsonDocument<JSON_OBJECT_SIZE(3) + 64> doc;
-      doc["dmin"] = otf_config.domain;
-      doc["port"] = otf_config.port;
-      doc["token"] = auth;
-      og.options[OPTION_OTF].sval = "";
-      serializeJson(doc, og.options[OPTION_OTF].sval);
+      const OTFStruct& otf_config = og.get_otf_config();
+      char json[192];  // size of the otf option slot
+      JsonWriter w(json, sizeof(json));
+      w.begin_object();
+      w.member(F("dmin"), otf_config.domain);
+      w.member(F("port"), otf_config.port);
+      w.member(F("token"), auth);
+      w.end_object();
+      if(!w.overflow()) og.options[OPTION_OTF].sval = w.c_str();
     }
     og.options_save();
     otf_send_result(res, HTML_SUCCESS, nullptr);
@@ -623,11 +947,13 @@ void on_ap_change_config(const OTF::Request &req, OTF::Response &res) {
 
 void on_ap_try_connect(const OTF::Request &req, OTF::Response &res) {
   if(curr_mode == OG_MOD_STA) return;
-  String json = "{";
-  json += F("\"ip\":");
-  json += (WiFi.status() == WL_CONNECTED) ? (uint32_t)WiFi.localIP() : 0;
-  json += F("}");
-  otf_send_json(res, json);
+  otf_send_json_header(res);
+  {
+    JsonWriter w(res);
+    w.begin_object();
+    w.member(F("ip"), (ulong)((WiFi.status() == WL_CONNECTED) ? (uint32_t)WiFi.localIP() : 0));
+    w.end_object();
+  }
   if(WiFi.status() == WL_CONNECTED && WiFi.localIP()) {
     /*DEBUG_PRINTLN(F("STA connected, updating option file"));
     og.options[OPTION_MOD].ival = OG_MOD_STA;
@@ -642,63 +968,165 @@ void on_ap_try_connect(const OTF::Request &req, OTF::Response &res) {
 }
 
 void on_ap_debug(const OTF::Request &req, OTF::Response &res) {
-  String json = "";
-  json += F("{");
-  json += F("\"dist\":");
-  json += og.read_distance();
-  json += F(",\"fwv\":");
-  json += og.options[OPTION_FWV].ival;
-  json += F("}");
-  otf_send_json(res, json);
+  otf_send_json_header(res);
+  JsonWriter w(res);
+  w.begin_object();
+  w.member(F("dist"), og.read_distance());
+  w.member(F("fwv"), og.options[OPTION_FWV].ival);
+  w.end_object();
 }
 
 // MQTT callback to read "Button" requests
-void mqtt_callback(char *topic, uint8_t *payload, unsigned int length) { 
-  String payload_string = String((char *)payload);
-  String topic_string = String(topic);
-
-  // DEBUG_PRINT("MQTT Message Received: ");
-  // DEBUG_PRINT(topic_string);
-  // DEBUG_PRINT(" Data: ");
-  // DEBUG_PRINTLN(payload_string);
+/* MQTT payloads are not null terminated, the helpers below work on
+ * (payload, length) and don't copy it. Commands that take parameters
+ * use the query string format: "dkey=xxx&riv=5&ddb=10". */
+bool payload_equals(const char *p, unsigned int len, const char *s) {
+  return strlen(s)==len && strncmp(p, s, len)==0;
+}
 
-  //Accept button on any topic for backwards compat with existing code - use IN messages below if possible
-  if (payload_string == "Button") {
-    DEBUG_PRINTLN(F("MQTT Button request received, change door state"));
-    if(!og.options[OPTION_ALM].ival) {
-      // if alarm is not enabled, trigger relay right away
-      og.click_relay();
-    } else if(og.options[OPTION_AOO].ival && !door_status) {
-      // if 'Do not alarm on open' is on, and door is about to be open, no alarm needed
-      og.click_relay();
-	  } else {
-      // else, set alarm
-      og.set_alarm();
+// find the value of key in the payload
+bool payload_param(const char *p, unsigned int len, const char *key, const char *&val, unsigned int &vlen) {
+  unsigned int klen = strlen(key);
+  const char *end = p+len;
+  while(p<end) {
+    const char *amp = (const char*)memchr(p, '&', end-p);
+    if(!amp) amp = end;
+    if((unsigned int)(amp-p)>klen && p[klen]=='=' && strncmp(p, key, klen)==0) {
+      val = p+klen+1;
+      vlen = amp-val;
+      return true;
     }
+    p = amp+1;
   }
-  //Accept click for consistency with api, open and close should be used instead, use IN topic if possible
-  if (topic_string == og.options[OPTION_NAME].sval + "/IN/STATE"){
-    DEBUG_PRINT(F("MQTT IN Message detected, check data for action, Data:"));
-    DEBUG_PRINTLN(payload_string);
-    if ((payload_string == "close" && door_status) || (payload_string == "open" && !door_status) || payload_string == "click") {
-      DEBUG_PRINTLN(F("Command is valid based on existing state, trigger change"));
-      if(!og.options[OPTION_ALM].ival) {
-        // if alarm is not enabled, trigger relay right away
-        og.click_relay();
-      } else if(og.options[OPTION_AOO].ival && !door_status) {
-      	// if 'Do not alarm on open' is on, and door is about to be open, no alarm needed
-      	og.click_relay();
-	    } else {
-        // else, set alarm
-        og.set_alarm();
+  return false;
+}
+
+bool payload_uint(const char *v, unsigned int vlen, uint &out) {
+  if(!vlen || vlen>9) return false;
+  out = 0;
+  for(unsigned int i=0;i<vlen;i++) {
+    if(v[i]<'0' || v[i]>'9') return false;
+    out = out*10 + (v[i]-'0');
+  }
+  return true;
+}
+
+bool payload_verify_key(const char *p, unsigned int len) {
+  const char *v;
+  unsigned int vlen;
+  return payload_param(p, len, "dkey", v, vlen) &&
+         vlen==og.options[OPTION_DKEY].sval.length() &&
+         strncmp(v, og.options[OPTION_DKEY].sval.c_str(), vlen)==0;
+}
+
+// report the outcome of an MQTT command, same format as the HTTP API
+void mqtt_send_result(byte code, const char *item = NULL) {
+  char buf[64];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object();
+  w.member(F("result"), code);
+  w.member(F("item"), item ? item : "");
+  w.end_object();
+  if(!w.overflow()) mqttclient.publish(og.get_mqtt_config().topic_result.c_str(), w.c_str());
+}
+
+// payload: open, close or click
+void mqtt_in_state(const char *p, unsigned int len) {
+  bool click = payload_equals(p, len, "click");
+  bool open = payload_equals(p, len, "open");
+  bool close = payload_equals(p, len, "close");
+  //Accept click for consistency with api, open and close should be used instead
+  if((close && door_status) || (open && !door_status) || click) {
+    DEBUG_PRINTLN(F("Command is valid based on existing state, trigger change"));
+    door_command(click ? 1-door_status : (open ? 1 : 0));
+  } else if(close || open) {
+    DEBUG_PRINTLN(F("Command request not valid, door already in requested state"));
+  } else {
+    DEBUG_PRINTLN(F("Unrecognized MQTT data/command"));
+  }
+}
+
+/* payload: dkey=xxx&<name>=<value>&...
+ * Integer options only, with the same limits as /co. Nothing is
+ * changed unless every parameter is valid. */
+void mqtt_in_options(const char *p, unsigned int len) {
+  for(byte round=0;round<2;round++) {
+    const char *end = p+len;
+    for(const char *q=p;q<end;) {
+      const char *amp = (const char*)memchr(q, '&', end-q);
+      if(!amp) amp = end;
+      const char *eq = (const char*)memchr(q, '=', amp-q);
+      char key[8];
+      unsigned int klen = eq ? eq-q : amp-q;
+      if(klen>=sizeof(key)) klen = sizeof(key)-1;
+      strncpy(key, q, klen);
+      key[klen] = 0;
+      if(!eq) { mqtt_send_result(HTML_DATA_FORMATERROR, key); return; }
+      if(strcmp(key, "dkey")) {
+        int i = og.find_option(q, eq-q);
+        uint ival;
+        if(i<0 || option_locked(i) || !og.option_max(i) || i==OPTION_USI) {
+          mqtt_send_result(HTML_NOT_PERMITTED, key);
+          return;
+        }
+        if(!payload_uint(eq+1, amp-eq-1, ival) || !option_in_range(i, ival)) {
+          mqtt_send_result(HTML_DATA_OUTOFBOUND, key);
+          return;
+        }
+        if(round && og.options[i].ival != ival) {
+          og.options[i].ival = ival;
+          reconfig_pending |= OPTION_BIT(i);
+        }
       }
-    }else if ((payload_string == "close" && !door_status) || (payload_string == "open" && door_status) ){
-      DEBUG_PRINTLN(F("Command request not valid, door already in requested state"));
+      q = amp+1;
     }
-    else {
-      DEBUG_PRINT(F("Unrecognized MQTT data/command:"));
-      DEBUG_PRINTLN(payload_string);
+  }
+  og.options_save();
+  mqtt_send_result(HTML_SUCCESS);
+}
+
+// payload: dkey=xxx
+void mqtt_in_reboot(const char *p, unsigned int len) {
+  mqtt_send_result(HTML_SUCCESS);
+  restart_in(1000);
+}
+
+struct MqttCommandStruct {
+  const char *suffix;  // topic after <topic>
+  bool auth;           // payload must carry the device key
+  void (*handler)(const char *payload, unsigned int length);
+};
+
+static const MqttCommandStruct mqtt_commands[] = {
+  {"/IN/STATE",   false, mqtt_in_state},
+  {"/IN/OPTIONS", true,  mqtt_in_options},
+  {"/IN/REBOOT",  true,  mqtt_in_reboot}
+};
+
+void mqtt_callback(char *topic, uint8_t *payload, unsigned int length) { 
+  const char *p = (const char*)payload;
+
+  //Accept button on any topic for backwards compat with existing code - use IN messages below if possible
+  if(payload_equals(p, length, "Button")) {
+    DEBUG_PRINTLN(F("MQTT Button request received, change door state"));
+    door_command(1-door_status);
+    return;  // door_command publishes, which overwrites topic and payload
+  }
+
+  const String& base = og.get_mqtt_config().topic;
+  if(strncmp(topic, base.c_str(), base.length())) return;
+  const char *suffix = topic + base.length();
+  for(byte i=0;i<sizeof(mqtt_commands)/sizeof(MqttCommandStruct);i++) {
+    const MqttCommandStruct& c = mqtt_commands[i];
+    if(strcmp(suffix, c.suffix)) continue;
+    DEBUG_PRINT(F("MQTT IN Message detected: "));
+    DEBUG_PRINTLN(suffix);
+    if(c.auth && !payload_verify_key(p, length)) {
+      mqtt_send_result(HTML_UNAUTHORIZED);
+      return;
     }
+    c.handler(p, length);
+    return;
   }
 }
 
@@ -714,32 +1142,27 @@ void do_setup()
     updateServer = NULL;
   }
   WiFi.persistent(false); // turn off persistent, fixing flash crashing issue
+  etag_boot = ESP.random();
   og.begin();
+  boot_begin = millis();
   og.options_setup();
+  boot_options = millis();
+  og.log_setup();
+  Outbox::begin();
   og.init_sensors();
+  boot_sensors = millis();
+  Notifier::begin(&mqttclient);
+  Events::begin(&mqttclient);
+  MqttConn::begin(&mqttclient);
   if(og.get_mode() == OG_MOD_AP) og.play_startup_tune();
   DEBUG_PRINT(F("Complile Info: "));
   DEBUG_PRINT(F(__DATE__));
   DEBUG_PRINT(F(" "));
   DEBUG_PRINTLN(F(__TIME__));
-  curr_cloud_access_en = og.get_cloud_access_en();
   curr_mode = og.get_mode();
   if(!otf) {
-    OTFStruct otf_config = og.get_otf_config();
-    // const String otfDeviceKey = og.options[OPTION_AUTH].sval;
-    
-    if(otf_config.token && otf_config.token.length() > 0) {
-      // Initialize with remote connection if a device key was specified.
-      otf = new OTF::OpenThingsFramework(og.options[OPTION_HTP].ival, otf_config.domain , otf_config.port , otf_config.token , false);
-      DEBUG_PRINTLN(F("Started OTF with remote connection"));
-    } else {
-      // Initialize just the local server if no device key was specified.
-      otf = new OTF::OpenThingsFramework(og.options[OPTION_HTP].ival);
-      DEBUG_PRINTLN(F("Started OTF with just local connection"));
-    }
+    otf_begin();
     if(curr_mode == OG_MOD_AP) dns = new DNSServer();
-    DEBUG_PRINT(F("server started @ "));
-    DEBUG_PRINTLN(og.options[OPTION_HTP].ival);
   }
   if(!updateServer) {
     updateServer = new ESP8266WebServer(8080);
@@ -823,7 +1246,7 @@ void on_ap_update(const OTF::Request &req, OTF::Response &res) {
 void on_sta_upload_fin() {
 
   // Verify the device key.
-  if(!(updateServer->hasArg("dkey") && (updateServer->arg("dkey") == og.options[OPTION_DKEY].sval))) {
+  if(!(updateServer->hasArg("dkey") && (updateServer->arg("dkey") == og.options[OPTION_DKEY].sval.c_str()))) {
     updateserver_send_result(HTML_UNAUTHORIZED);
     Update.end(false); // Update.reset(); FAB
     return;
@@ -908,84 +1331,33 @@ void check_status_ap() {
   }
 }
 
+/* Connect to the broker one step per loop pass (see MqttConn), then
+ * subscribe and announce the device once the connection is up */
 bool mqtt_connect_subscibe() {
-
-  MqttStruct mqtt_config = og.get_mqtt_config();
-
-  static ulong mqtt_subscribe_timeout = 0;
-  if(curr_utc_time > mqtt_subscribe_timeout) {
-    if (!mqttclient.connected()) {
-      DEBUG_PRINT(F("MQTT Not connected- (Re)connect MQTT"));
-      
-      mqttclient.setServer(mqtt_config.domain.c_str(), mqtt_config.port);
-      
-      bool connected;
-      // if a user name and password exist
-      if (mqtt_config.username.length() > 0 && mqtt_config.password.length() > 0) {
-        connected = mqttclient.connect(
-          mqtt_config.topic.c_str(), 
-          mqtt_config.username.c_str(),
-          mqtt_config.password.c_str(), 
-          (mqtt_config.topic + "/OUT/STATUS").c_str(),
-          1,
-          true,
-          "offline"
-        );
-      } else {
-        connected = mqttclient.connect(
-          mqtt_config.topic.c_str(),
-          (mqtt_config.topic + "/OUT/STATUS").c_str(),
-          1,
-          true,
-          "offline"
-        );
-      }
-
-      if (connected) {
-        mqttclient.setCallback(mqtt_callback); 		
-        mqttclient.subscribe(mqtt_config.topic.c_str());
-        mqttclient.subscribe((mqtt_config.topic +"/IN/#").c_str());
-        mqttclient.publish((mqtt_config.topic + "/OUT/STATUS").c_str(), "online", true);
-        DEBUG_PRINTLN(F("......Success, Subscribed to MQTT Topic"));
-        return true;
-      }else {
-        DEBUG_PRINTLN(F("......Failed to Connect to MQTT"));
-        mqtt_subscribe_timeout = curr_utc_time + 50; //Takes about 5 seconds to get through the loop
-        return false;
-      }
-    }
-  }
+  if(!MqttConn::step()) return false;
+  const MqttStruct& mqtt_config = og.get_mqtt_config();
+  mqttclient.setCallback(mqtt_callback);
+  // PubSubClient doesn't tell whether the broker still had our session,
+  // subscribing again is harmless. With a persistent session QoS 1 makes
+  // the broker hold commands sent while we were offline.
+  byte qos = mqtt_config.persistent ? 1 : 0;
+  mqttclient.subscribe(mqtt_config.topic.c_str(), qos);
+  mqttclient.subscribe(mqtt_config.topic_in.c_str(), qos);
+  mqttclient.publish(mqtt_config.topic_status.c_str(), "online", true);
+  DEBUG_PRINTLN(F("......Success, Subscribed to MQTT Topic"));
+  // state may have changed while we were offline
+  publish_door_state();
+  tele_force = true;
+  return true;
 }
 
 void perform_notify(String s) {
   DEBUG_PRINT(F("Sending Notify to connected systems, value:"));
   DEBUG_PRINTLN(s);
 
-  // IFTTT notification
-  IFTTTStruct ifttt_config = og.get_ifttt_config();
-  if(ifttt_config.token.length()>7) { // key size is at least 8
-    DEBUG_PRINTLN(" Sending IFTTT Notification");
-    http.begin("http://maker.ifttt.com/trigger/"+ifttt_config.trigger+"/with/key/"+ifttt_config.token);
-    http.addHeader("Content-Type", "application/json");
-    http.POST("{\"value1\":\""+s+"\"}");
-    String payload = http.getString();
-    http.end();
-    if(payload.indexOf("Congratulations") >= 0) {
-      DEBUG_PRINTLN(" Successfully updated IFTTT");
-    }else{
-      DEBUG_PRINT(" Error from IFTTT: ");
-      DEBUG_PRINTLN(payload);
-    }
-  }
-
-  //Mqtt notification
-  MqttStruct mqtt_config = og.get_mqtt_config();
-  if(mqtt_config.domain.length()>8) {
-    if (mqttclient.connected()) {
-        DEBUG_PRINTLN(" Sending MQTT Notification");
-        mqttclient.publish((mqtt_config.topic + "/OUT/NOTIFY").c_str(), s.c_str()); 
-    }
-  }
+  // IFTTT and MQTT (OUT/NOTIFY) notifications are delivered by Notifier::loop(),
+  // the door change itself goes to OUT/EVENT through the outbox
+  Notifier::push(s);
 }
 
 void process_dynamics(byte event) {
@@ -1000,7 +1372,7 @@ void process_dynamics(byte event) {
   if(event == DOOR_STATUS_JUST_OPENED) {
     justopen_timestamp = curr_utc_time; // record time stamp
     if (noto & OG_NOTIFY_DO)
-      { perform_notify(og.options[OPTION_NAME].sval + " just OPENED!");}
+      { perform_notify(String(og.options[OPTION_NAME].sval.c_str()) + " just OPENED!");}
     
     //If the door is set to auto close at a certain hour, ensure if manually opened it doesn't autoshut
     if( (curr_utc_hour == og.options[OPTION_ATIB].ival) && (!automationclose_triggered) ){
@@ -1011,7 +1383,7 @@ void process_dynamics(byte event) {
   } else if (event == DOOR_STATUS_JUST_CLOSED) {
     justopen_timestamp = 0; // reset time stamp
     if (noto & OG_NOTIFY_DC)
-      { perform_notify(og.options[OPTION_NAME].sval + " just CLOSED!");}
+      { perform_notify(String(og.options[OPTION_NAME].sval.c_str()) + " just CLOSED!");}
 
   } else if (event == DOOR_STATUS_REMAIN_OPEN) {
     if (!justopen_timestamp) justopen_timestamp = curr_utc_time; // record time stamp
@@ -1020,7 +1392,7 @@ void process_dynamics(byte event) {
         // reached timeout, perform action
         if(ato & OG_AUTO_NOTIFY) {
           // send notification
-          String s = og.options[OPTION_NAME].sval+" is left open for more than ";
+          String s = String(og.options[OPTION_NAME].sval.c_str())+" is left open for more than ";
           s+= og.options[OPTION_ATI].ival;
           s+= " minutes.";
           if(ato & OG_AUTO_CLOSE) {
@@ -1045,7 +1417,7 @@ void process_dynamics(byte event) {
         automationclose_triggered=true;
         if(atob & OG_AUTO_NOTIFY) {
           // send notification
-          String s = og.options[OPTION_NAME].sval+" is open after ";
+          String s = String(og.options[OPTION_NAME].sval.c_str())+" is open after ";
           s+= og.options[OPTION_ATIB].ival;
           s+= " UTC. Current hour:";
           s+= curr_utc_hour;
@@ -1077,158 +1449,121 @@ void process_dynamics(byte event) {
   }
 }
 
-void check_status() {
-  static ulong checkstatus_timeout = 0;
-  static ulong checkstatus_report_timeout = 0; 
-  if((curr_utc_time > checkstatus_timeout) || (checkstatus_timeout == 0))  { //also check on first boot
-    og.set_led(HIGH);
-    aux_ticker.once_ms(25, og.set_led, (byte)LOW);
-    uint threshold = og.options[OPTION_DTH].ival;
-    uint vthreshold = og.options[OPTION_VTH].ival;
-    if ((og.options[OPTION_MNT].ival == OG_MNT_SIDE) || (og.options[OPTION_MNT].ival == OG_MNT_CEILING)){
-      //sensor is ultrasonic
-      distance = og.read_distance();
-      door_status = (distance>threshold)?0:1; 
-      if (og.options[OPTION_MNT].ival == OG_MNT_SIDE){
-       door_status = 1-door_status;  // reverse logic for side mount
-       vehicle_status = 3;}
-      else {
-        if (vthreshold >0) {
-          if (!door_status) {
-            vdistance = distance;
-            vehicle_status = ((vdistance>threshold) && (vdistance <=vthreshold))?1:0;
-          }else{vehicle_status = 2;}
-        }else {vehicle_status = 3;}
-      }
-    }else if (og.options[OPTION_MNT].ival == OG_SWITCH_LOW){
-      vehicle_status= 3;
-      if (og.get_switch() == LOW){
-        //DEBUG_PRINTLN("Low Mount Switch reads LOW, setting distance to high value (indicating closed)");
-        door_status =0; 
-        distance = threshold + 20;
-      }
-      else{
-        //DEBUG_PRINTLN("Low Mount Switch reads HIGH, setting distance to low value (indicating open)");
-        door_status =1; 
-        distance = threshold - 20;
-      }
-    }else if (og.options[OPTION_MNT].ival == OG_SWITCH_HIGH){
-      vehicle_status= 3;
-      if (og.get_switch() == LOW){
-        //DEBUG_PRINTLN("High Mount Switch reads LOW, setting distance to low value (indicating open)");
-        door_status =1; 
-        distance = threshold - 20;
-      }
-      else{
-        //DEBUG_PRINTLN("High Mount Switch reads HIGH, setting distance to high value (indicating closed)");
-        door_status =0; 
-        distance = threshold + 20;
-      }
+// publish the current door state to MQTT, retained so that
+// new subscribers get it right away
+void publish_door_state() {
+  const MqttStruct& mqtt_config = og.get_mqtt_config();
+  if((mqtt_config.domain.length()>8) && (mqttclient.connected())) {
+    DEBUG_PRINTLN(F(" Update MQTT (State Change)"));
+    if(door_status == DOOR_STATUS_REMAIN_OPEN)  {						// MQTT: If door open...
+      mqttclient.publish(mqtt_config.topic_state.c_str(), "OPEN", true);
+      mqttclient.publish(mqtt_config.topic.c_str(), "Open", true); //Support existing mqtt code
+    } 
+    else if(door_status == DOOR_STATUS_REMAIN_CLOSED) {					// MQTT: If door closed...
+      mqttclient.publish(mqtt_config.topic_state.c_str(), "CLOSED", true);
+      mqttclient.publish(mqtt_config.topic.c_str(), "Closed", true); //Support existing mqtt code
     }
-    read_cnt = (read_cnt+1)%100;
-    // get temperature readings
-    og.read_TH_sensor(tempC, humid);
-    if (checkstatus_timeout == 0){
-      DEBUG_PRINTLN(F("First time checking status don't trigger a status change, set full history to current value"));
-      if (door_status) { door_status_hist = B11111111; }
-      else { door_status_hist = B00000000; }
-    }else{
-       door_status_hist = (door_status_hist<<1) | door_status;
+  }
+}
+
+/* Door detection. Runs on every distance sample completed by the
+ * echo ISR (every dri ms); switch mounts are sampled at the same rate.
+ * The door status histogram is shifted once per sample with the newest
+ * unfiltered sample, so a door event is reported DOOR_STATUS_HIST_K/2
+ * samples (about 1 s at the default dri) after the door crosses the
+ * threshold, and a single stray echo is debounced away. The dfw median
+ * only smooths the reported distance: thresholding it would add about
+ * dfw/2 samples to the delay. */
+void check_door() {
+  static bool first_sample = true;
+  static ulong switch_timeout = 0;
+  uint threshold = og.options[OPTION_DTH].ival;
+  uint vthreshold = og.options[OPTION_VTH].ival;
+  byte mnt = og.options[OPTION_MNT].ival;
+  byte sample_status;
+  uint prev_distance = distance;
+
+  if((mnt == OG_MNT_SIDE) || (mnt == OG_MNT_CEILING)) {
+    //sensor is ultrasonic
+    if(!og.new_distance_sample()) return;
+    distance = og.read_distance();
+    sample_status = (og.read_distance_last()>threshold)?0:1;
+    if(mnt == OG_MNT_SIDE) sample_status = 1-sample_status;  // reverse logic for side mount
+  } else {
+    if((long)(millis()-switch_timeout) < 0) return;
+    switch_timeout = millis() + og.options[OPTION_DRI].ival;
+    if(mnt == OG_SWITCH_LOW) {
+      sample_status = (og.get_switch() == LOW) ? 0 : 1;
+    } else {
+      sample_status = (og.get_switch() == LOW) ? 1 : 0;
     }
-    //DEBUG_PRINT(F("Histogram value:"));
-    //DEBUG_PRINTLN(door_status_hist);
-    //DEBUG_PRINT(F("Vehicle Status:"));
-    //DEBUG_PRINTLN(vehicle_status);
-    byte event = check_door_status_hist();
-
-    //Upon change
-    if(event == DOOR_STATUS_JUST_OPENED || event == DOOR_STATUS_JUST_CLOSED) {
-      // write log record
-      DEBUG_PRINTLN(" Update Local Log"); 
-      LogStruct l;
-      l.tstamp = curr_utc_time;
-      l.status = door_status;
-      l.dist = distance;
-      og.write_log(l);
-
-#if 0
-      //Debug Beep (only if sound is enabled)
-      if(og.options[OPTION_ALM].ival){
-        og.play_note(1000);
-        delay(500);
-        og.play_note(0);
-      }
-      DEBUG_PRINT(curr_utc_time);
-      if(event == DOOR_STATUS_JUST_OPENED)  {	
-        DEBUG_PRINTLN(F(" Sending State Change event to connected systems, value: DOOR_STATUS_JUST_OPENED")); }
-      else if(event == DOOR_STATUS_JUST_CLOSED) {	
-        DEBUG_PRINTLN(F(" Sending State Change event to connected systems, value: DOOR_STATUS_JUST_CLOSED")); }
-#endif
-
-#if 0
-      byte ato = og.options[OPTION_ATO].ival;
-
-      // IFTTT notification
-      if(og.options[OPTION_IFTT].sval.length()>7) { // key size is at least 8
-        DEBUG_PRINTLN(F(" Notify IFTTT (State Change)")); 
-        http.begin("http://maker.ifttt.com/trigger/opengarage/with/key/"+og.options[OPTION_IFTT].sval);
-        http.addHeader("Content-Type", "application/json");
-        http.POST("{\"value1\":\""+String(event,DEC)+"\"}");
-        String payload = http.getString();
-        http.end();
-        if(payload.indexOf("Congratulations") >= 0) {
-          DEBUG_PRINTLN(F("  Successfully updated IFTTT"));
-        }else{
-          DEBUG_PRINT(F("  ERROR from IFTTT: "));
-          DEBUG_PRINTLN(payload);
-        }
-      }
+    // report the switch as a distance on the matching side of the threshold
+    distance = sample_status ? threshold - 20 : threshold + 20;
+  }
 
-      //Mqtt notification
-      if(og.options[OPTION_MQTT].sval.length()>8) {
-        if (mqttclient.connected()) {
-          DEBUG_PRINTLN(F(" Update MQTT (State Change)"));
-          mqttclient.publish(og.options[OPTION_NAME].sval + "/OUT/CHANGE",String(event,DEC)); 
-        }
-      }
-#endif
-    } //End state change updates
+  if(first_sample) {
+    DEBUG_PRINTLN(F("First door sample, don't trigger a status change, set full history to current value"));
+    door_status_hist = sample_status ? B11111111 : B00000000;
+    first_sample = false;
+  } else {
+    door_status_hist = (door_status_hist<<1) | sample_status;
+  }
+  byte event = check_door_status_hist();
+  byte prev_status = door_status;
+  // door_status only follows debounced transitions
+  if(event == DOOR_STATUS_REMAIN_OPEN || event == DOOR_STATUS_JUST_OPENED) door_status = 1;
+  else if(event == DOOR_STATUS_REMAIN_CLOSED || event == DOOR_STATUS_JUST_CLOSED) door_status = 0;
+
+  if(mnt == OG_MNT_CEILING) {
+    if(vthreshold > 0) {
+      if(!door_status) {
+        vdistance = distance;
+        vehicle_status = ((vdistance>threshold) && (vdistance <=vthreshold))?1:0;
+      } else { vehicle_status = 2; }
+    } else { vehicle_status = 3; }
+  } else {
+    vehicle_status = 3;
+  }
 
-    //Send current status only on change and longer interval
-    if ((curr_utc_time >checkstatus_report_timeout) || (event == DOOR_STATUS_JUST_OPENED || event == DOOR_STATUS_JUST_CLOSED) ){
-#if 0
-      DEBUG_PRINT(curr_utc_time);
-      if(event == DOOR_STATUS_REMAIN_OPEN)  {	
-        DEBUG_PRINTLN(F(" Sending State Refresh to connected systems, value: OPEN")); }
-      else if(event == DOOR_STATUS_REMAIN_CLOSED) {	
-        DEBUG_PRINTLN(F(" Sending State Refresh to connected systems, value: CLOSED")); }
-#endif
-      
-      //IFTTT only recieves state change events not ongoing status
-
-      //Mqtt update
-      MqttStruct mqtt_config = og.get_mqtt_config();
-      if((mqtt_config.domain.length()>8) && (mqttclient.connected())) {
-        DEBUG_PRINTLN(F(" Update MQTT (State Refresh)"));
-        if(door_status == DOOR_STATUS_REMAIN_OPEN)  {						// MQTT: If door open...
-          mqttclient.publish((mqtt_config.topic + "/OUT/STATE").c_str(), "OPEN");
-          mqttclient.publish(mqtt_config.topic.c_str(), "Open"); //Support existing mqtt code
-          //DEBUG_PRINTLN(curr_utc_time + " Sending MQTT State otification: OPEN");
-        } 
-        else if(door_status == DOOR_STATUS_REMAIN_CLOSED) {					// MQTT: If door closed...
-          mqttclient.publish((mqtt_config.topic + "/OUT/STATE").c_str(), "CLOSED");
-          mqttclient.publish(mqtt_config.topic.c_str(), "Closed"); //Support existing mqtt code
-          //DEBUG_PRINTLN(curr_utc_time + " Sending MQTT State Notification: CLOSED");
-        }
-      }
-      // Send status report every 15 seconds: we don't need to send updates frequently if there is no status change.
-      checkstatus_report_timeout= curr_utc_time + 15; 
-    }
-    
+  if(door_status != prev_status || distance != prev_distance) og.set_dirty_bit(DIRTY_BIT_JC, 1);
+  push_status(event);
+
+  //Upon change
+  if(event == DOOR_STATUS_JUST_OPENED || event == DOOR_STATUS_JUST_CLOSED) {
+    // write log record
+    DEBUG_PRINTLN(" Update Local Log"); 
+    LogStruct l;
+    l.tstamp = curr_utc_time;
+    l.status = door_status;
+    l.dist = distance;
+    og.write_log(l);
+    publish_door_state();
+    Events::queue(OUTBOX_DOOR, curr_utc_time, door_status ? "OPEN" : "CLOSED");
     // Process dynamics: automation and notifications
     process_dynamics(event);
-    checkstatus_timeout = curr_utc_time + og.options[OPTION_RIV].ival;
+  }
+}
+
+/* Periodic status check, every riv seconds: reads temperature and
+ * signal strength and runs the timed automation rules. Door events are
+ * handled by check_door(), MQTT updates by publish_telemetry(). */
+void check_status() {
+  if((curr_utc_time > checkstatus_timeout) || (checkstatus_timeout == 0))  { //also check on first boot
+    og.set_led(HIGH);
+    aux_ticker.once_ms(25, og.set_led, (byte)LOW);
+    read_cnt = (read_cnt+1)%100;
+    // values reported by /jc are sampled here so that its ETag
+    // only has to change once per status check
+    rssi = (int16_t)WiFi.RSSI();
+    otc_status = otf->getCloudStatus();
+    otc_change = curr_utc_time - otf->getTimeSinceLastCloudStatusChange() / 1000;
+    og.set_dirty_bit(DIRTY_BIT_JC, 1);
+    // start a temperature reading, collected by collect_TH()
+    og.TH_start();
     
+    // Process dynamics: timed automation rules
+    process_dynamics(door_status ? DOOR_STATUS_REMAIN_OPEN : DOOR_STATUS_REMAIN_CLOSED);
+    checkstatus_timeout = curr_utc_time + og.options[OPTION_RIV].ival;
   }
 }
 
@@ -1267,6 +1602,159 @@ void time_keeping() {
   }
 }
 
+// pick up the values of a temperature / humidity reading once they are ready
+void collect_TH() {
+  byte got = og.TH_loop(tempC, humid);
+  if(got & TH_GOT_TEMP) temp_tstamp = curr_utc_time;
+  if(got & TH_GOT_HUMID) humid_tstamp = curr_utc_time;
+  if(got) og.set_dirty_bit(DIRTY_BIT_JC, 1);
+}
+
+/* Door sensing, the log, commands and automation only need the local
+ * clock, they keep running while WiFi is down. */
+void process_local() {
+  time_keeping();
+  collect_TH();
+  check_door();   //This detects door events on every new sensor sample
+  check_command();
+  check_status(); //This sends info to services and processes the automation rules
+}
+
+/* Called while the station is not connected. The SDK reconnects on its
+ * own after short drops, if that has not worked the association is
+ * restarted with a full scan, backing off up to WIFI_RETRY_MAX. */
+void wifi_reconnect() {
+  if(!wifi_lost_ms) {
+    DEBUG_PRINTLN(F("WiFi connection lost"));
+    // the socket would stay open until it times out, writes to it block the loop
+    mqttclient.disconnect();
+    wifi_lost_ms = millis();
+    if(!wifi_lost_ms) wifi_lost_ms = 1;
+    wifi_backoff = WIFI_RETRY_MIN;
+    wifi_retry_ms = millis() + wifi_backoff;
+    led_blink_ms = LED_SLOW_BLINK;
+    return;
+  }
+  if((long)(millis()-wifi_retry_ms) < 0) return;
+  DEBUG_PRINT(F("Re-associating, next try in "));
+  DEBUG_PRINTLN(wifi_backoff);
+  WiFi.disconnect();
+  start_network_sta(og.options[OPTION_SSID].sval.c_str(), og.options[OPTION_PASS].sval.c_str());
+  og.config_ip();
+  wifi_retry_ms = millis() + wifi_backoff;
+  wifi_backoff = (wifi_backoff*2 > WIFI_RETRY_MAX) ? WIFI_RETRY_MAX : wifi_backoff*2;
+}
+
+// seconds the current lease can still be reused after a restart, 0 if there is none
+uint32_t wifi_lease_left() {
+  if(og.options[OPTION_USI].ival) return 0;
+  if(wifi_lease_end) {
+    long left = (long)(wifi_lease_end-millis());
+    return left>0 ? left/1000 : 0;
+  }
+  return og.dhcp_lease_left();
+}
+
+/* Save the WiFi cache on connect and every WIFI_CACHE_REFRESH, so that
+ * a restart only reuses the lease while it is valid. A reused lease is
+ * a static config and never renewed, once it is due DHCP is started
+ * and the cache gets whatever the server grants. */
+void wifi_cache_update() {
+  if(wifi_lease_end && (long)(millis()-wifi_lease_end) >= 0) {
+    DEBUG_PRINTLN(F("Cached lease is due, start DHCP"));
+    wifi_lease_end = 0;
+    WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+  }
+  og.wifi_cache_save(wifi_lease_left());
+  wifi_cache_time = millis();
+}
+
+void wifi_restored() {
+  if(!wifi_lost_ms) return;
+  ulong d = millis()-wifi_lost_ms;
+  DEBUG_PRINT(F("WiFi restored after "));
+  DEBUG_PRINTLN(d);
+  wifi_outages++;
+  wifi_outage_last = d;
+  wifi_outage_total += d;
+  if(d > wifi_outage_max) wifi_outage_max = d;
+  wifi_lost_ms = 0;
+  led_blink_ms = 0;
+  og.set_led(LOW);
+  wifi_cache_update();
+}
+
+void otf_begin() {
+  const OTFStruct& otf_config = og.get_otf_config();
+  // const String otfDeviceKey = og.options[OPTION_AUTH].sval;
+
+  curr_cloud_access_en = og.get_cloud_access_en();
+  if(otf_config.token && otf_config.token.length() > 0) {
+    // Initialize with remote connection if a device key was specified.
+    otf = new OTF::OpenThingsFramework(og.options[OPTION_HTP].ival, otf_config.domain , otf_config.port , otf_config.token , false);
+    DEBUG_PRINTLN(F("Started OTF with remote connection"));
+  } else {
+    // Initialize just the local server if no device key was specified.
+    otf = new OTF::OpenThingsFramework(og.options[OPTION_HTP].ival);
+    DEBUG_PRINTLN(F("Started OTF with just local connection"));
+  }
+  DEBUG_PRINT(F("server started @ "));
+  DEBUG_PRINTLN(og.options[OPTION_HTP].ival);
+}
+
+void otf_register_sta() {
+  otf->on("/", on_home);
+  otf->on("/jc", on_sta_controller);
+  otf->on("/jo", on_sta_options);
+  otf->on("/jl", on_sta_logs);
+  otf->on("/vo", on_sta_view_options);
+  otf->on("/vl", on_sta_view_logs);
+  otf->on("/cc", on_sta_change_controller);
+  otf->on("/co", on_sta_change_options);
+  otf->on("/db", on_sta_debug);
+  // FIXME get sta updates working.
+  otf->on("/update", on_sta_update, OTF::HTTP_GET);
+  otf->on("/clearlog", on_clear_log);
+  otf->on("/resetall",on_reset_all);
+}
+
+/* Apply options changed through /co or MQTT to the subsystems that
+ * use them, without a restart. Called from the main loop, never from
+ * a request handler, since the HTTP server may be replaced. Options
+ * not handled here are read where they are used, or (static IP, log
+ * size) take effect on the next boot. */
+void reconfigure() {
+  if(!reconfig_pending) return;
+  uint64_t changed = reconfig_pending;
+  reconfig_pending = 0;
+  if(changed & OPTION_BIT(OPTION_DRI)) {
+    DEBUG_PRINTLN(F("Rearm distance sensor"));
+    og.init_distance_sensor();
+  }
+  if(changed & OPTION_BIT(OPTION_TSN)) {
+    DEBUG_PRINTLN(F("Switch temperature sensor"));
+    og.init_TH_sensor();
+    tempC = 0;
+    humid = 0;
+    temp_tstamp = 0;
+    humid_tstamp = 0;
+    checkstatus_timeout = 0;  // read the new sensor right away
+  }
+  if(changed & OPTION_BIT(OPTION_RIV)) checkstatus_timeout = 0;
+  if(changed & (OPTION_BIT(OPTION_HTP) | OPTION_BIT(OPTION_OTF))) {
+    DEBUG_PRINTLN(F("Restart OTF server"));
+    delete otf;
+    otf_begin();
+    otf_register_sta();
+  }
+  if(changed & OPTION_BIT(OPTION_MQTT)) {
+    // reconnect to the new broker right away
+    DEBUG_PRINTLN(F("Reconnect MQTT"));
+    mqttclient.disconnect();
+    MqttConn::reset();
+  }
+}
+
 void process_alarm() {
   if(!og.alarm) return;
   static ulong prev_half_sec = 0;
@@ -1320,10 +1808,31 @@ void do_loop() {
       DEBUG_PRINT(F("Attempting to connect to SSID: "));
       DEBUG_PRINTLN(og.options[OPTION_SSID].sval.c_str());
       WiFi.mode(WIFI_STA);
-      start_network_sta(og.options[OPTION_SSID].sval.c_str(), og.options[OPTION_PASS].sval.c_str());
+      wifi_assoc_handler = WiFi.onStationModeConnected([](const WiFiEventStationModeConnected&) {
+        if(!boot_assoc) boot_assoc = millis();
+      });
+      wifi_dhcp_handler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP&) {
+        if(!boot_dhcp) boot_dhcp = millis();
+      });
+      WifiCacheStruct c;
+      wifi_fast = og.wifi_cache_load(c);
+      if(wifi_fast) {
+        DEBUG_PRINTLN(F("Using cached BSSID and channel"));
+        start_network_sta(og.options[OPTION_SSID].sval.c_str(), og.options[OPTION_PASS].sval.c_str(), c.channel, c.bssid);
+        // reuse the last lease while it is valid, unless a static IP is set.
+        // The cache may be up to WIFI_CACHE_REFRESH older than the restart.
+        if(c.has_ip && c.lease_left > WIFI_CACHE_REFRESH/1000 && !og.options[OPTION_USI].ival) {
+          WiFi.config(IPAddress(c.ip), IPAddress(c.gw), IPAddress(c.subn), IPAddress(c.dns));
+          wifi_lease_end = millis() + (c.lease_left-WIFI_CACHE_REFRESH/1000)*1000UL;
+          if(!wifi_lease_end) wifi_lease_end = 1;
+        }
+      } else {
+        start_network_sta(og.options[OPTION_SSID].sval.c_str(), og.options[OPTION_PASS].sval.c_str());
+      }
       og.config_ip();
+      wifi_fast_timeout = millis() + WIFI_FAST_TIMEOUT;
       og.state = OG_STATE_CONNECTING;
-      connecting_timeout = millis() + 60000;
+      connecting_timeout = millis() + WIFI_CONNECT_TIMEOUT;
     }
     break;
 
@@ -1340,23 +1849,20 @@ void do_loop() {
     if(WiFi.status() == WL_CONNECTED) {
       DEBUG_PRINT(F("Wireless connected, IP: "));
       DEBUG_PRINTLN(WiFi.localIP());
+      if(wifi_lost_ms) wifi_restored();
+      else wifi_cache_update();
 
-      otf->on("/", on_home);
-      otf->on("/jc", on_sta_controller);
-      otf->on("/jo", on_sta_options);
-      otf->on("/jl", on_sta_logs);
-      otf->on("/vo", on_sta_view_options);
-      otf->on("/vl", on_sta_view_logs);
-      otf->on("/cc", on_sta_change_controller);
-      otf->on("/co", on_sta_change_options);
-      otf->on("/db", on_sta_debug);
-      // FIXME get sta updates working.
-      otf->on("/update", on_sta_update, OTF::HTTP_GET);
+      otf_register_sta();
       updateServer->on("/update", HTTP_POST, on_sta_upload_fin, on_sta_upload);
-      otf->on("/clearlog", on_clear_log);
-      otf->on("/resetall",on_reset_all);
       updateServer->begin();
       DEBUG_PRINTLN(F("Web Server endpoints (STA mode) registered"));
+      if(!wsserver) {
+        wsserver = new WebSocketsServer(WS_PORT);
+        wsserver->onEvent(on_ws_event);
+        wsserver->begin();
+        DEBUG_PRINT(F("status push server started @ "));
+        DEBUG_PRINTLN(WS_PORT);
+      }
 
       // use ap ssid as mdns name
       if(MDNS.begin(get_ap_ssid().c_str(), WiFi.localIP())) {
@@ -1374,10 +1880,23 @@ void do_loop() {
       og.set_led(LOW);
       og.state = OG_STATE_CONNECTED;
       connecting_timeout = 0;
+    } else if(wifi_fast && millis() > wifi_fast_timeout) {
+      // the cached access point or lease did not work, scan and use DHCP
+      DEBUG_PRINTLN(F("Fast connect failed, full scan"));
+      wifi_fast = false;
+      wifi_lease_end = 0;
+      og.wifi_cache_clear();
+      WiFi.disconnect();
+      if(!og.options[OPTION_USI].ival) WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+      start_network_sta(og.options[OPTION_SSID].sval.c_str(), og.options[OPTION_PASS].sval.c_str());
+      og.config_ip();
+      connecting_timeout = millis() + WIFI_CONNECT_TIMEOUT;
     } else {
-      if(millis() > connecting_timeout) {
-        DEBUG_PRINTLN(F("Wifi Connecting timeout, restart"));
-        og.restart();
+      // the door is watched while the first connection is being made,
+      // once it times out the outage is counted and retried with backoff
+      process_local();
+      if(wifi_lost_ms || (long)(millis()-connecting_timeout) > 0) {
+        wifi_reconnect();
       }
     }
     break;
@@ -1418,29 +1937,30 @@ void do_loop() {
     } else {
       if(WiFi.status() == WL_CONNECTED) {
       	//MDNS.update();
-        time_keeping();
-        check_status(); //This checks the door, sends info to services and processes the automation rules
+        wifi_restored();
+        if(millis()-wifi_cache_time > WIFI_CACHE_REFRESH) wifi_cache_update();
+        process_local();
         otf->loop();
         updateServer->handleClient();
+        wsserver->loop();
 
         //Handle MQTT
         if(og.get_mqtt_config().domain.length()>8) {
           if (!mqttclient.connected()) {
             mqtt_connect_subscibe();
           }
-          else {mqttclient.loop();} //Processes MQTT Pings/keep alives
+          else {
+            mqttclient.loop(); //Processes MQTT Pings/keep alives
+            Events::drain();
+            publish_telemetry();
+          }
         }
-        connecting_timeout = 0;
+        Notifier::loop();
+        reconfigure();
       } else {
-        //og.state = OG_STATE_INITIAL;
-        if(!connecting_timeout) {
-          DEBUG_PRINTLN(F("State is CONNECTED but WiFi is disconnected, start timeout counter."));
-          connecting_timeout = millis()+60000;
-        }
-        else if(millis() > connecting_timeout) {
-          DEBUG_PRINTLN(F("timeout reached, reboot"));
-          og.restart();
-        }
+        // keep sensing and logging, MQTT events go to the outbox
+        process_local();
+        wifi_reconnect();
       }
     }
     break;
@@ -1448,6 +1968,8 @@ void do_loop() {
 
   //Nework independent functions, handle events like reset even when not connected
   process_ui();
+  og.log_process();
+  og.options_process();
   if(og.alarm)
     process_alarm();
 }
@@ -0,0 +1,186 @@
+/* OpenGarage Firmware
+ *
+ * MQTT connection
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "mqttconn.h"
+
+PubSubClient* MqttConn::mqttclient = NULL;
+WiFiClient MqttConn::wificlient;
+BearSSL::WiFiClientSecure MqttConn::wificlient_tls;
+BearSSL::Session MqttConn::tls_session;
+WiFiClient* MqttConn::transport = &MqttConn::wificlient;
+byte MqttConn::state = MQTT_WAIT;
+ulong MqttConn::retry_time = 0;
+ulong MqttConn::backoff = 0;
+ulong MqttConn::fails = 0;
+IPAddress MqttConn::ip;
+String MqttConn::ip_host;
+ulong MqttConn::ip_time = 0;
+String MqttConn::tls_host;
+uint MqttConn::tls_port = 0;
+uint16_t MqttConn::tls_rx = 0;
+uint16_t MqttConn::tls_probe = 0;
+ulong MqttConn::connect_start = 0;
+ulong MqttConn::connect_ms = 0;
+
+void MqttConn::fail() {
+  transport->stop();
+  fails++;
+  backoff = backoff ? backoff*2 : MQTT_BACKOFF_MIN;
+  if(backoff > MQTT_BACKOFF_MAX) backoff = MQTT_BACKOFF_MAX;
+  // wait somewhere between half and all of the backoff, so that
+  // devices that lost the broker together don't retry together
+  retry_time = millis() + backoff/2 + random(backoff/2);
+  state = MQTT_WAIT;
+}
+
+void MqttConn::reset() {
+  state = MQTT_WAIT;
+  retry_time = millis();
+  backoff = 0;
+}
+
+// whether the broker accepted a TLS fragment length that fits
+bool MqttConn::tls_probed(const MqttStruct& mqtt_config) {
+  return tls_rx && tls_port == mqtt_config.port && tls_host == mqtt_config.domain;
+}
+
+bool MqttConn::step() {
+  const MqttStruct& mqtt_config = OpenGarage::get_mqtt_config();
+
+  switch(state) {
+  case MQTT_WAIT:
+    if((long)(millis()-retry_time) < 0) return false;
+    DEBUG_PRINTLN(F("MQTT Not connected- (Re)connect MQTT"));
+    state = MQTT_RESOLVE;
+    break;
+
+  case MQTT_RESOLVE: {
+    IPAddress addr;
+    if(mqtt_config.tls && tls_probed(mqtt_config)) {
+      // resolved by the TLS client, which needs the name for SNI
+    } else if(addr.fromString(mqtt_config.domain)) {
+      ip = addr;
+    } else if(!ip_time || ip_host != mqtt_config.domain || millis()-ip_time > MQTT_DNS_TTL) {
+      if(!WiFi.hostByName(mqtt_config.domain.c_str(), ip, MQTT_CONNECT_TIMEOUT)) {
+        DEBUG_PRINTLN(F("......Failed to resolve MQTT broker"));
+        ip_time = 0;
+        fail();
+        return false;
+      }
+      ip_host = mqtt_config.domain;
+      ip_time = millis();
+      if(!ip_time) ip_time = 1;
+    }
+    tls_probe = 0;
+    state = (mqtt_config.tls && !tls_probed(mqtt_config)) ? MQTT_PROBE : MQTT_TCP;
+    } break;
+
+  case MQTT_PROBE:
+    /* The default 16 KB TLS receive buffer does not fit, the broker has
+     * to accept a smaller maximum fragment length. A plain connect bounded
+     * by MQTT_CONNECT_TIMEOUT checks first that the broker can be reached,
+     * then one length is probed per pass. Only an accepted length is kept,
+     * if there is none the attempt fails and is retried with backoff. */
+    if(!tls_probe) {
+      wificlient.setTimeout(MQTT_CONNECT_TIMEOUT);
+      transport = &wificlient;
+      if(!wificlient.connect(ip, mqtt_config.port)) {
+        DEBUG_PRINTLN(F("......Failed to reach MQTT broker"));
+        ip_time = 0;
+        fail();
+        return false;
+      }
+      wificlient.stop();
+      tls_probe = MQTT_TLS_MFLN_MIN;
+      break;
+    }
+    if(BearSSL::WiFiClientSecure::probeMaxFragmentLength(ip, mqtt_config.port, tls_probe)) {
+      tls_host = mqtt_config.domain;
+      tls_port = mqtt_config.port;
+      tls_rx = tls_probe;
+      state = MQTT_TCP;
+    } else if((tls_probe <<= 1) > MQTT_TLS_MFLN_MAX) {
+      DEBUG_PRINTLN(F("......MQTT broker accepts no TLS fragment length that fits"));
+      fail();
+      return false;
+    }
+    break;
+
+  case MQTT_TCP:
+    connect_start = millis();
+    if(mqtt_config.tls) {
+      // the broker certificate is only checked against a configured fingerprint,
+      // without one the connection is encrypted but not authenticated (/db reports it)
+      if(mqtt_config.fingerprint.length()) wificlient_tls.setFingerprint(mqtt_config.fingerprint.c_str());
+      else {
+        DEBUG_PRINTLN(F("......No MQTT broker fingerprint, TLS is insecure"));
+        wificlient_tls.setInsecure();
+      }
+      wificlient_tls.setBufferSizes(tls_rx, MQTT_TLS_TX);
+      wificlient_tls.setSession(&tls_session);
+      wificlient_tls.setTimeout(MQTT_TLS_TIMEOUT);
+      transport = &wificlient_tls;
+    } else {
+      wificlient.setTimeout(MQTT_CONNECT_TIMEOUT);
+      transport = &wificlient;
+    }
+    mqttclient->setClient(*transport);
+    if(!(mqtt_config.tls ? transport->connect(mqtt_config.domain.c_str(), mqtt_config.port)
+                         : transport->connect(ip, mqtt_config.port))) {
+      DEBUG_PRINTLN(F("......Failed to reach MQTT broker"));
+      ip_time = 0;  // resolve again on the next attempt
+      fail();
+      return false;
+    }
+    state = MQTT_HANDSHAKE;
+    break;
+
+  case MQTT_HANDSHAKE: {
+    // the connection is already open, connect() only exchanges CONNECT / CONNACK
+    if(mqtt_config.tls) mqttclient->setServer(mqtt_config.domain.c_str(), mqtt_config.port);
+    else mqttclient->setServer(ip, mqtt_config.port);
+    mqttclient->setSocketTimeout(MQTT_CONNECT_TIMEOUT/1000);
+    // if a user name and password exist
+    bool auth = mqtt_config.username.length() > 0 && mqtt_config.password.length() > 0;
+    bool connected = mqttclient->connect(
+      mqtt_config.topic.c_str(),
+      auth ? mqtt_config.username.c_str() : NULL,
+      auth ? mqtt_config.password.c_str() : NULL,
+      mqtt_config.topic_status.c_str(),
+      1,
+      true,
+      "offline",
+      !mqtt_config.persistent  // clean session
+    );
+
+    if (connected) {
+      connect_ms = millis() - connect_start;
+      backoff = 0;
+      state = MQTT_WAIT;
+      return true;
+    }
+    DEBUG_PRINTLN(F("......Failed to Connect to MQTT"));
+    fail();
+    } break;
+  }
+  return false;
+}
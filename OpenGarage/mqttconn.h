@@ -0,0 +1,76 @@
+/* OpenGarage Firmware
+ *
+ * MQTT connection header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MQTT_CONN_H
+#define _MQTT_CONN_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+#include "defines.h"
+#include "OpenGarage.h"
+
+/* MQTT connection state machine. Each step runs on its own loop pass:
+ * resolve the broker (cached for MQTT_DNS_TTL), open the TCP connection,
+ * then send CONNECT and wait for the broker's reply. The last two are
+ * blocking calls in WiFiClient / PubSubClient, bounded by
+ * MQTT_CONNECT_TIMEOUT. TLS connections are opened by name so that the
+ * broker gets SNI, the first one to a broker is preceded by the
+ * MQTT_PROBE steps. Failed attempts are retried after a jittered,
+ * exponentially growing delay. */
+class MqttConn {
+public:
+  static void begin(PubSubClient *mqtt) { mqttclient = mqtt; }
+  static bool step();   // one step per loop pass, true when the connection just came up
+  static void reset();  // connect again right away, e.g. to a new broker
+  static byte get_state() { return state; }
+  static ulong get_fails() { return fails; }
+  static ulong get_backoff() { return backoff; }
+  static uint16_t get_tls_rx() { return tls_rx; }
+  static ulong get_connect_ms() { return connect_ms; }
+private:
+  static void fail();
+  static bool tls_probed(const MqttStruct& mqtt_config);
+
+  static PubSubClient *mqttclient;
+  static WiFiClient wificlient;
+  static BearSSL::WiFiClientSecure wificlient_tls;
+  static BearSSL::Session tls_session;  // kept so that TLS reconnects resume the session
+  static WiFiClient *transport;
+
+  static byte state;
+  static ulong retry_time;  // millis() of the next connect attempt
+  static ulong backoff;
+  static ulong fails;
+  static IPAddress ip;
+  static String ip_host;    // broker host ip was resolved for
+  static ulong ip_time;     // millis() when ip was resolved, 0 if not resolved
+  static String tls_host;   // broker the TLS fragment length was accepted by
+  static uint tls_port;
+  static uint16_t tls_rx;   // TLS receive buffer size for tls_host, 0 if none yet
+  static uint16_t tls_probe;  // fragment length to probe next, 0 until the broker was reached
+  static ulong connect_start;
+  static ulong connect_ms;  // duration of the last successful connect, TCP to CONNACK
+};
+
+#endif  // _MQTT_CONN_H
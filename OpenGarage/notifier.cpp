@@ -0,0 +1,200 @@
+/* OpenGarage Firmware
+ *
+ * Notification dispatcher
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "notifier.h"
+#include "OpenGarage.h"
+
+NotifyStruct Notifier::queue[NOTIFY_QUEUE_SIZE];
+byte Notifier::head = 0;
+byte Notifier::count = 0;
+NotifyStatStruct Notifier::stats[NUM_NOTIFY_SINKS];
+ulong Notifier::coalesced = 0;
+ulong Notifier::overflows = 0;
+PubSubClient* Notifier::mqttclient = NULL;
+
+WiFiClient Notifier::ifttt_client;
+IPAddress Notifier::ifttt_ip;
+ulong Notifier::ifttt_ip_time = 0;
+int Notifier::ifttt_entry = -1;
+ulong Notifier::ifttt_timeout = 0;
+
+void Notifier::push(const String& msg) {
+  byte sinks = 0;
+  if(OpenGarage::get_ifttt_config().token.length()>7) sinks |= 1<<NOTIFY_SINK_IFTTT; // key size is at least 8
+  if(OpenGarage::get_mqtt_config().domain.length()>8) sinks |= 1<<NOTIFY_SINK_MQTT;
+  if(!sinks) return;
+
+  // coalesce with the newest entry if it is the same message and
+  // still has to go to all the sinks. An entry that is in flight or
+  // partly delivered is left alone, its sinks are not armed again.
+  if(count) {
+    int i = (head+count-1)%NOTIFY_QUEUE_SIZE;
+    NotifyStruct& n = queue[i];
+    if(i!=ifttt_entry && (n.pending&sinks)==sinks && n.msg == msg) {
+      coalesced++;
+      return;
+    }
+  }
+  if(count==NOTIFY_QUEUE_SIZE) {
+    DEBUG_PRINTLN(F("Notification queue full, message dropped"));
+    overflows++;
+    return;
+  }
+  NotifyStruct& n = queue[(head+count)%NOTIFY_QUEUE_SIZE];
+  n.msg = msg;
+  n.queued = millis();
+  for(byte s=0;s<NUM_NOTIFY_SINKS;s++) {
+    n.next_try[s] = n.queued;
+    n.tries[s] = 0;
+  }
+  n.pending = sinks;
+  count++;
+}
+
+void Notifier::loop() {
+  ifttt_loop();
+  mqtt_loop();
+  // release delivered messages
+  while(count && !queue[head].pending) {
+    queue[head].msg = String();
+    head = (head+1)%NOTIFY_QUEUE_SIZE;
+    count--;
+  }
+}
+
+// oldest entry that is due for the given sink, -1 if none
+int Notifier::next_entry(byte sink) {
+  for(byte k=0;k<count;k++) {
+    int i = (head+k)%NOTIFY_QUEUE_SIZE;
+    NotifyStruct& n = queue[i];
+    if(!(n.pending & (1<<sink))) continue;
+    if((long)(millis()-n.next_try[sink]) < 0) return -1;  // keep the order per sink
+    return i;
+  }
+  return -1;
+}
+
+void Notifier::done(int i, byte sink) {
+  NotifyStruct& n = queue[i];
+  NotifyStatStruct& st = stats[sink];
+  n.pending &= ~(1<<sink);
+  st.sent++;
+  st.last_ms = millis()-n.queued;
+  st.total_ms += st.last_ms;
+  if(st.last_ms > st.max_ms) st.max_ms = st.last_ms;
+}
+
+void Notifier::fail(int i, byte sink) {
+  NotifyStruct& n = queue[i];
+  if(++n.tries[sink] >= NOTIFY_MAX_TRIES) {
+    DEBUG_PRINTLN(F(" Notification failed, giving up"));
+    n.pending &= ~(1<<sink);
+    stats[sink].failed++;
+    return;
+  }
+  stats[sink].retries++;
+  n.next_try[sink] = millis() + ((ulong)NOTIFY_RETRY_BASE << (n.tries[sink]-1));
+}
+
+bool Notifier::ifttt_resolve() {
+  if(ifttt_ip_time && (millis()-ifttt_ip_time < NOTIFY_DNS_TTL)) return true;
+  if(!WiFi.hostByName(IFTTT_HOST, ifttt_ip, NOTIFY_CONNECT_TIMEOUT)) {
+    ifttt_ip_time = 0;
+    return false;
+  }
+  ifttt_ip_time = millis();
+  if(!ifttt_ip_time) ifttt_ip_time = 1;
+  return true;
+}
+
+void Notifier::ifttt_loop() {
+  if(ifttt_entry < 0) {
+    // send the next request
+    int i = next_entry(NOTIFY_SINK_IFTTT);
+    if(i<0) return;
+    const IFTTTStruct& ifttt_config = OpenGarage::get_ifttt_config();
+    if(ifttt_config.token.length()<8) { // IFTTT has been disabled meanwhile
+      queue[i].pending &= ~(1<<NOTIFY_SINK_IFTTT);
+      return;
+    }
+    DEBUG_PRINTLN(F(" Sending IFTTT Notification"));
+    // DNS lookup and TCP connect block, each is bounded by
+    // NOTIFY_CONNECT_TIMEOUT. The lookup result is cached for NOTIFY_DNS_TTL,
+    // the reply is waited for on the following passes.
+    ifttt_client.setTimeout(NOTIFY_CONNECT_TIMEOUT);
+    if(!ifttt_resolve() || !ifttt_client.connect(ifttt_ip, 80)) {
+      DEBUG_PRINTLN(F(" Error connecting to IFTTT"));
+      ifttt_ip_time = 0;  // resolve again on the next attempt
+      fail(i, NOTIFY_SINK_IFTTT);
+      return;
+    }
+    String body = "{\"value1\":\""+queue[i].msg+"\"}";
+    String req = "POST /trigger/"+ifttt_config.trigger+"/with/key/"+ifttt_config.token+" HTTP/1.1\r\n";
+    req += F("Host: " IFTTT_HOST "\r\nContent-Type: application/json\r\nConnection: close\r\nContent-Length: ");
+    req += body.length();
+    req += F("\r\n\r\n");
+    req += body;
+    ifttt_client.print(req);
+    ifttt_entry = i;
+    ifttt_timeout = millis() + NOTIFY_TIMEOUT;
+    return;
+  }
+
+  // wait for the status line of the reply: "HTTP/1.1 200 OK"
+  if(ifttt_client.available() >= 12) {
+    char buf[13];
+    ifttt_client.read((uint8_t*)buf, 12);
+    buf[12] = 0;
+    ifttt_client.stop();
+    if(atoi(buf+9) == 200) {
+      DEBUG_PRINTLN(F(" Successfully updated IFTTT"));
+      done(ifttt_entry, NOTIFY_SINK_IFTTT);
+    } else {
+      DEBUG_PRINT(F(" Error from IFTTT: "));
+      DEBUG_PRINTLN(buf);
+      fail(ifttt_entry, NOTIFY_SINK_IFTTT);
+    }
+    ifttt_entry = -1;
+  } else if(!ifttt_client.connected() || (long)(millis()-ifttt_timeout) > 0) {
+    DEBUG_PRINTLN(F(" No reply from IFTTT"));
+    ifttt_client.stop();
+    fail(ifttt_entry, NOTIFY_SINK_IFTTT);
+    ifttt_entry = -1;
+  }
+}
+
+void Notifier::mqtt_loop() {
+  int i = next_entry(NOTIFY_SINK_MQTT);
+  if(i<0 || !mqttclient) return;
+  const MqttStruct& mqtt_config = OpenGarage::get_mqtt_config();
+  if(mqtt_config.domain.length()<=8) { // MQTT has been disabled meanwhile
+    queue[i].pending &= ~(1<<NOTIFY_SINK_MQTT);
+    return;
+  }
+  if(mqttclient->connected() &&
+     mqttclient->publish(mqtt_config.topic_notify.c_str(), queue[i].msg.c_str())) {
+    DEBUG_PRINTLN(F(" Sent MQTT Notification"));
+    done(i, NOTIFY_SINK_MQTT);
+  } else {
+    fail(i, NOTIFY_SINK_MQTT);
+  }
+}
@@ -0,0 +1,92 @@
+/* OpenGarage Firmware
+ *
+ * Notification dispatcher header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NOTIFIER_H
+#define _NOTIFIER_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+#include "defines.h"
+
+enum {
+  NOTIFY_SINK_IFTTT = 0,
+  NOTIFY_SINK_MQTT,
+  NUM_NOTIFY_SINKS
+};
+
+struct NotifyStatStruct {
+  ulong sent;
+  ulong failed;    // dropped after NOTIFY_MAX_TRIES attempts
+  ulong retries;
+  ulong last_ms;   // queueing to delivery latency of the last notification
+  ulong max_ms;
+  ulong total_ms;
+};
+
+struct NotifyStruct {
+  String msg;
+  ulong queued;    // millis() when queued
+  ulong next_try[NUM_NOTIFY_SINKS];
+  byte tries[NUM_NOTIFY_SINKS];
+  byte pending;    // bitmask of sinks the message still has to go to
+};
+
+/* Notifications are queued by push() and delivered by loop(), which
+ * never waits for a reply: the IFTTT request is sent and its reply
+ * is picked up on a later pass. Failed deliveries are retried with
+ * exponential backoff, a message that repeats the newest queued one
+ * is not queued again. */
+class Notifier {
+public:
+  static void begin(PubSubClient *mqtt) { mqttclient = mqtt; }
+  static void push(const String& msg);
+  static void loop();
+  static const NotifyStatStruct& get_stats(byte sink) { return stats[sink]; }
+  static ulong get_coalesced() { return coalesced; }
+  static ulong get_overflows() { return overflows; }
+  static byte get_queued() { return count; }
+private:
+  static void ifttt_loop();
+  static void mqtt_loop();
+  static int next_entry(byte sink);
+  static void done(int i, byte sink);
+  static void fail(int i, byte sink);
+  static bool ifttt_resolve();
+
+  static NotifyStruct queue[];
+  static byte head;
+  static byte count;
+  static NotifyStatStruct stats[];
+  static ulong coalesced;
+  static ulong overflows;
+  static PubSubClient *mqttclient;
+
+  static WiFiClient ifttt_client;
+  static IPAddress ifttt_ip;
+  static ulong ifttt_ip_time;   // millis() when ifttt_ip was resolved, 0 if not resolved
+  static int ifttt_entry;       // entry waiting for a reply, -1 if none
+  static ulong ifttt_timeout;
+};
+
+#endif  // _NOTIFIER_H
@@ -0,0 +1,469 @@
+/* OpenGarage Firmware
+ *
+ * Option store
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "OpenGarage.h"
+
+OTFStruct OpenGarage::otf_config;
+MqttStruct OpenGarage::mqtt_config;
+IFTTTStruct OpenGarage::ifttt_config;
+ulong OpenGarage::options_save_time = 0;
+
+static const char* config_fname = CONFIG_FNAME;
+static const char* config_tmp_fname = CONFIG_TMP_FNAME;
+static const char* config_txt_fname = CONFIG_TXT_FNAME;
+
+/* Option metadata, in flash. Integer options have a max value > 0,
+ * string options have max 0, a default string and a fixed size slot
+ * in option_arena. */
+static const char opt_def_empty[] PROGMEM = "";
+static const char opt_def_otf[]   PROGMEM = DEFUALT_OTF_JSON;
+static const char opt_def_dkey[]  PROGMEM = DEFAULT_DKEY;
+static const char opt_def_name[]  PROGMEM = DEFAULT_NAME;
+static const char opt_def_iftt[]  PROGMEM = DEFAULT_IFTTT_JSON;
+static const char opt_def_mqtt[]  PROGMEM = DEFAULT_MQTT_JSON;
+
+#define LK OPTION_FLAG_LOCKED
+#define SC OPTION_FLAG_SECRET
+#define JS OPTION_FLAG_JSON
+#define IP OPTION_FLAG_IP
+static constexpr OptionInfo option_table[] PROGMEM = {
+  {"fwv", OG_FWV,         0,   255, opt_def_empty, 0, LK},
+  {"mnt", OG_MNT_CEILING, 0,     3, opt_def_empty, 0, 0},
+  {"dth", 50,             0, 65535, opt_def_empty, 0, 0},
+  {"vth", 150,            0, 65535, opt_def_empty, 0, 0},
+  {"riv", 5,              0,   300, opt_def_empty, 0, 0},
+  {"alm", OG_ALM_5,       0,     2, opt_def_empty, 0, 0},
+  {"aoo", 0,              0,     1, opt_def_empty, 0, 0},
+  {"lsz", DEFAULT_LOG_SIZE,20, 400, opt_def_empty, 0, 0},
+  {"tsn", OG_TSN_NONE,    0,   255, opt_def_empty, 0, 0},
+  {"htp", 80,             0, 65535, opt_def_empty, 0, 0},
+  {"cdt", 1000,          50,  5000, opt_def_empty, 0, 0},
+  {"dri", 500,           50,  3000, opt_def_empty, 0, 0},
+  {"sto", 0,              0,     1, opt_def_empty, 0, 0},
+  {"mod", OG_MOD_AP,      0,   255, opt_def_empty, 0, LK},
+  {"ati", 30,             0,   720, opt_def_empty, 0, 0},
+  {"ato", OG_AUTO_NONE,   0,   255, opt_def_empty, 0, 0},
+  {"atib", 3,             0,    24, opt_def_empty, 0, 0},
+  {"atob", OG_AUTO_NONE,  0,   255, opt_def_empty, 0, 0},
+  {"noto", OG_NOTIFY_DO|OG_NOTIFY_DC,0,255, opt_def_empty, 0, 0},
+  {"usi", 0,              0,     1, opt_def_empty, 0, 0},
+  {"ddb", 5,              0,   500, opt_def_empty, 0, 0},
+  {"tdb", 5,              0,   100, opt_def_empty, 0, 0},
+  {"dfw", 7,              1, DFW_MAX, opt_def_empty, 0, 0},
+  {"cmr", 0,              0,     1, opt_def_empty, 0, 0},
+  {"thb", 300,            0,  3600, opt_def_empty, 0, 0},
+  // string options have 0 max value, the size includes the terminator
+  {"ssid", 0, 0, 0, opt_def_empty, 33,  LK},
+  {"pass", 0, 0, 0, opt_def_empty, 65,  LK|SC},
+  {"otf",  0, 0, 0, opt_def_otf,   192, JS},
+  {"dkey", 0, 0, 0, opt_def_dkey,  65,  LK|SC},
+  {"name", 0, 0, 0, opt_def_name,  49,  0},
+  {"iftt", 0, 0, 0, opt_def_iftt,  128, JS},
+  {"mqtt", 0, 0, 0, opt_def_mqtt,  320, JS},
+  // IP options are kept packed in ival, 0 if not set
+  {"dvip", 0,                        0, 0, opt_def_empty, 0, IP},
+  {"gwip", 0,                        0, 0, opt_def_empty, 0, IP},
+  {"subn", OPTION_IP(255,255,255,0), 0, 0, opt_def_empty, 0, IP},
+  {"dns1", OPTION_IP(8,8,8,8),       0, 0, opt_def_empty, 0, IP}
+};
+#undef LK
+#undef SC
+#undef JS
+#undef IP
+static_assert(sizeof(option_table)/sizeof(option_table[0]) == NUM_OPTIONS, "option table does not match OG_OPTION_enum");
+static_assert(NUM_OPTIONS <= 64, "OPTION_BIT needs a wider mask");
+
+/* Perfect hash of the option names: FNV-1a with a seed chosen so that
+ * no two names share a slot of option_slots. The slots are filled at
+ * compile time and a colliding name fails the static_assert below,
+ * in that case pick another OPTION_HASH_SEED. */
+static constexpr uint32_t option_hash(const char *s, size_t n, uint32_t h=OPTION_HASH_SEED) {
+  return n ? option_hash(s+1, n-1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+static constexpr size_t option_name_len(const char *s) {
+  return *s ? 1+option_name_len(s+1) : 0;
+}
+static constexpr uint32_t option_slot(byte i) {
+  return option_hash(option_table[i].name, option_name_len(option_table[i].name)) % OPTION_HASH_SIZE;
+}
+static constexpr bool option_slot_free(byte i, byte j) {
+  return j>=NUM_OPTIONS || (option_slot(i)!=option_slot(j) && option_slot_free(i, j+1));
+}
+static constexpr bool option_hash_perfect(byte i=0) {
+  return i>=NUM_OPTIONS || (option_slot_free(i, i+1) && option_hash_perfect(i+1));
+}
+static_assert(option_hash_perfect(), "option names collide, change OPTION_HASH_SEED");
+static constexpr byte option_at_slot(uint32_t s, byte i=0) {
+  return i>=NUM_OPTIONS ? 0xFF : (option_slot(i)==s ? i : option_at_slot(s, i+1));
+}
+#define SLOT8(s) option_at_slot(s), option_at_slot(s+1), option_at_slot(s+2), option_at_slot(s+3), \
+                 option_at_slot(s+4), option_at_slot(s+5), option_at_slot(s+6), option_at_slot(s+7)
+static constexpr byte option_slots[OPTION_HASH_SIZE] PROGMEM = {
+  SLOT8(0), SLOT8(8), SLOT8(16), SLOT8(24), SLOT8(32),
+  SLOT8(40), SLOT8(48), SLOT8(56), SLOT8(64), SLOT8(72)
+};
+#undef SLOT8
+static_assert(OPTION_HASH_SIZE == 80, "option_slots initializer has 80 entries");
+
+// the option table order, stored in the config file header
+static constexpr uint32_t option_layout(byte i=0, uint32_t h=OPTION_HASH_SEED) {
+  return i>=NUM_OPTIONS ? h :
+    option_layout(i+1, option_hash(option_table[i].name, option_name_len(option_table[i].name)+1, h));
+}
+// evaluated by the compiler, so the table in flash is never read for it
+static constexpr uint32_t OPTION_LAYOUT = option_layout();
+
+// offset of a string option in option_arena
+static constexpr uint option_offset(byte i) {
+  return i ? option_offset(i-1)+option_table[i-1].size : 0;
+}
+static char option_arena[option_offset(NUM_OPTIONS)];
+
+OptionStruct OpenGarage::options[NUM_OPTIONS];
+char OptionString::empty[1] = "";
+
+OptionString& OptionString::operator=(const char *s) {
+  if(!size) return *this;
+  strncpy(buf, s ? s : "", size-1);
+  buf[size-1] = 0;
+  return *this;
+}
+
+OptionString& OptionString::operator=(const __FlashStringHelper *s) {
+  if(!size) return *this;
+  strncpy_P(buf, (PGM_P)s, size-1);
+  buf[size-1] = 0;
+  return *this;
+}
+
+void OpenGarage::option_info(byte i, OptionInfo& info) {
+  memcpy_P(&info, &option_table[i], sizeof(info));
+}
+
+const __FlashStringHelper* OpenGarage::option_name(byte i) {
+  return FPSTR(option_table[i].name);
+}
+
+uint OpenGarage::option_max(byte i) {
+  return pgm_read_dword(&option_table[i].max);
+}
+
+byte OpenGarage::option_flags(byte i) {
+  return pgm_read_byte(&option_table[i].flags);
+}
+
+// index of the option with the given name, -1 if there is none
+int OpenGarage::find_option(const char *name, size_t len) {
+  if(!len || len>OPTION_NAME_SIZE) return -1;
+  byte i = pgm_read_byte(&option_slots[option_hash(name, len) % OPTION_HASH_SIZE]);
+  if(i>=NUM_OPTIONS) return -1;
+  if(strncmp_P(name, option_table[i].name, len) || pgm_read_byte(&option_table[i].name[len])) return -1;
+  return i;
+}
+
+void OpenGarage::options_defaults() {
+  OptionInfo info;
+  char *p = option_arena;
+  for(byte i=0;i<NUM_OPTIONS;i++) {
+    option_info(i, info);
+    options[i].ival = info.def;
+    options[i].sval.bind(p, info.size);
+    options[i].sval = FPSTR(info.sdef);
+    p += info.size;
+  }
+}
+
+// dotted IP option value, "-.-.-.-" stands for not set
+bool OpenGarage::parse_ip_option(const char *s, uint& ival) {
+  IPAddress ip;
+  if(!*s || !strcmp(s, "-.-.-.-")) ival = 0;
+  else if(ip.fromString(s)) ival = (uint32_t)ip;
+  else return false;
+  return true;
+}
+
+void OpenGarage::options_setup() {
+  options_defaults();
+  options_load();
+  // the firmware version is not written back on its own, the file is
+  // only rewritten when it was migrated or the option table changed
+  options[OPTION_FWV].ival = OG_FWV;
+}
+
+void OpenGarage::options_reset() {
+  DEBUG_PRINT(F("reset to factory default..."));
+  options_save_time = 0;
+  SPIFFS.remove(config_txt_fname);
+  SPIFFS.remove(config_tmp_fname);
+  if(!SPIFFS.remove(config_fname)) {
+    DEBUG_PRINTLN(F("failed to remove config file"));
+    return;
+  }else{DEBUG_PRINTLN(F("Removed config file"));}
+  DEBUG_PRINTLN(F("ok"));
+}
+
+/* Read a binary config file with a single read. If it was written with
+ * the same option table the records are taken in table order, otherwise
+ * they are matched by name and the file is rewritten. */
+bool OpenGarage::options_read(const char *fname) {
+  File file = SPIFFS.open(fname, "r");
+  if(!file) return false;
+  size_t size = file.size();
+  if(size<sizeof(ConfigHeader) || size>CONFIG_MAX_SIZE) {
+    file.close();
+    return false;
+  }
+  byte *buf = new byte[size];
+  bool ok = (file.readBytes((char*)buf, size) == size);
+  file.close();
+  ConfigHeader h;
+  memcpy(&h, buf, sizeof(h));
+  const byte *p = buf+sizeof(h);
+  const byte *end = buf+size;
+  if(!ok || h.magic!=CONFIG_MAGIC || h.version!=CONFIG_VERSION || h.size!=(size_t)(end-p) ||
+     h.crc!=crc32(p, h.size)) {
+    DEBUG_PRINTLN(F("bad config file"));
+    delete[] buf;
+    return false;
+  }
+  bool same_layout = (h.layout==OPTION_LAYOUT && h.nopts==NUM_OPTIONS);
+  for(uint k=0;k<h.nopts && p+CONFIG_NAME_SIZE+2<=end;k++) {
+    char name[CONFIG_NAME_SIZE+1];
+    memcpy(name, p, CONFIG_NAME_SIZE);
+    name[CONFIG_NAME_SIZE] = 0;
+    uint16_t len;
+    memcpy(&len, p+CONFIG_NAME_SIZE, 2);
+    p += CONFIG_NAME_SIZE+2;
+    if(p+len>end) break;
+    int idx = same_layout ? k : find_option(name, strlen(name));
+    if(idx>=0) {
+      OptionStruct& o = options[idx];
+      bool is_ip = option_flags(idx) & OPTION_FLAG_IP;
+      if(option_max(idx) || (is_ip && len==sizeof(uint32_t))) {  // this is an integer option
+        uint32_t v = 0;
+        if(len==sizeof(v)) memcpy(&v, p, sizeof(v));
+        o.ival = v;
+      } else if(len && !p[len-1]) {  // this is a string option
+        if(is_ip) parse_ip_option((const char*)p, o.ival);
+        else o.sval = (const char*)p;
+      }
+    }
+    p += len;
+  }
+  delete[] buf;
+  // shared options are kept, new options get their defaults
+  if(!same_layout || fname==config_tmp_fname) options_save();
+  return true;
+}
+
+// text config of earlier firmwares, one name:value line per option
+bool OpenGarage::options_read_text() {
+  File file = SPIFFS.open(config_txt_fname, "r");
+  if(!file) return false;
+  byte nopts = 0;
+  while(file.available()) {
+    String name = file.readStringUntil(':');
+    String sval = file.readStringUntil('\n');
+    sval.trim();
+    DEBUG_PRINT(name);
+    DEBUG_PRINT(":");
+    DEBUG_PRINTLN(sval);
+    nopts++;
+    if(nopts>NUM_OPTIONS+1) break;
+    int idx = find_option(name.c_str(), name.length());
+    if(idx<0) continue;
+    if(option_max(idx)) {  // this is an integer option
+      options[idx].ival = sval.toInt();
+    } else if(option_flags(idx) & OPTION_FLAG_IP) {
+      parse_ip_option(sval.c_str(), options[idx].ival);
+    } else {  // this is a string option
+      options[idx].sval = sval;
+    }
+  }
+  file.close();
+  return true;
+}
+
+void OpenGarage::options_load() {
+  DEBUG_PRINT(F("loading config file..."));
+  // a missing file with a temporary file left means the device was
+  // reset between writing and renaming it
+  if(options_read(config_fname) || options_read(config_tmp_fname)) {
+    DEBUG_PRINTLN(F("ok"));
+  } else if(options_read_text()) {
+    DEBUG_PRINTLN(F("migrated"));
+    options_save();
+    options_flush();
+    SPIFFS.remove(config_txt_fname);
+  } else {
+    DEBUG_PRINTLN(F("using defaults"));
+    options_save();
+    options_flush();
+  }
+  parse_configs();
+}
+
+/* Option changes are applied right away and written once no further
+ * change came in for CONFIG_SAVE_DELAY ms, so that a burst of changes
+ * costs a single flash write. options_flush() must be called before a
+ * restart. */
+void OpenGarage::options_save() {
+  options_save_time = millis();
+  if(!options_save_time) options_save_time = 1;
+  parse_configs();
+  set_dirty_bit(DIRTY_BIT_JO, 1);
+  set_dirty_bit(DIRTY_BIT_JC, 1);  // /jc reports name and fwv
+}
+
+void OpenGarage::options_process() {
+  if(options_save_time && millis()-options_save_time >= CONFIG_SAVE_DELAY) options_flush();
+}
+
+/* Changes stay pending until the new file has replaced the old one, a
+ * failed write is retried after another CONFIG_SAVE_DELAY. */
+void OpenGarage::options_flush() {
+  if(!options_save_time) return;
+  DEBUG_PRINT(F("saving config file..."));
+  ConfigHeader h;
+  h.magic = CONFIG_MAGIC;
+  h.version = CONFIG_VERSION;
+  h.nopts = NUM_OPTIONS;
+  h.layout = OPTION_LAYOUT;
+  h.size = 0;
+  OptionStruct *o = options;
+  for(byte i=0;i<NUM_OPTIONS;i++,o++) {
+    bool is_int = option_max(i) || (option_flags(i) & OPTION_FLAG_IP);
+    h.size += CONFIG_NAME_SIZE+2+(is_int ? sizeof(uint32_t) : o->sval.length()+1);
+  }
+  if(sizeof(h)+h.size > CONFIG_MAX_SIZE) {
+    DEBUG_PRINTLN(F("too large"));
+    options_save_time = 0;  // would never fit
+    return;
+  }
+  byte *buf = new byte[sizeof(h)+h.size];
+  byte *p = buf+sizeof(h);
+  o = options;
+  for(byte i=0;i<NUM_OPTIONS;i++,o++) {
+    bool is_int = option_max(i) || (option_flags(i) & OPTION_FLAG_IP);
+    strncpy_P((char*)p, option_table[i].name, CONFIG_NAME_SIZE);
+    uint16_t len = is_int ? sizeof(uint32_t) : o->sval.length()+1;
+    memcpy(p+CONFIG_NAME_SIZE, &len, 2);
+    p += CONFIG_NAME_SIZE+2;
+    if(is_int) {
+      uint32_t v = o->ival;
+      memcpy(p, &v, sizeof(v));
+    } else {
+      memcpy(p, o->sval.c_str(), len);
+    }
+    p += len;
+  }
+  h.crc = crc32(buf+sizeof(h), h.size);
+  memcpy(buf, &h, sizeof(h));
+  // write a new file and swap it in, the old file stays intact until then
+  File file = SPIFFS.open(config_tmp_fname, "w");
+  bool ok = file && (file.write(buf, sizeof(h)+h.size) == sizeof(h)+h.size);
+  if(file) file.close();
+  delete[] buf;
+  // a file left in config_tmp_fname is picked up by options_load
+  if(!ok || (SPIFFS.exists(config_fname) && !SPIFFS.remove(config_fname)) ||
+     !SPIFFS.rename(config_tmp_fname, config_fname)) {
+    DEBUG_PRINTLN(F("failed"));
+    options_save_time = millis();
+    if(!options_save_time) options_save_time = 1;
+    return;
+  }
+  options_save_time = 0;
+  DEBUG_PRINTLN(F("ok"));
+}
+
+/* JSON options are parsed from a writable copy in json, which ArduinoJson
+ * then uses in place instead of copying every key and value into the
+ * document. The documents only need room for the members (a few spare
+ * ones included), and json has to outlive doc. */
+template<size_t N>
+static void parse_option_json(StaticJsonDocument<N>& doc, byte i, char *json) {
+  strcpy(json, OpenGarage::options[i].sval.c_str());
+  DeserializationError err = deserializeJson(doc, json);
+  if(err) {
+    DEBUG_PRINT(F("JSON option error: "));
+    DEBUG_PRINTLN(err.c_str());
+  }
+}
+
+/* Deserialize the JSON config options into their cached structs.
+ * Only called when options are loaded or saved, so that the main
+ * loop can read the configs without parsing or allocating. */
+void OpenGarage::parse_configs() {
+  {
+    char json[option_table[OPTION_OTF].size];
+    StaticJsonDocument<JSON_OBJECT_SIZE(3+2)> doc;
+    DEBUG_PRINT(F("Deserializing OTF JSON: "));
+    DEBUG_PRINTLN(options[OPTION_OTF].sval.c_str());
+    parse_option_json(doc, OPTION_OTF, json);
+    otf_config.domain = doc["dmin"].as<String>();
+    otf_config.port = doc["port"];
+    otf_config.token = doc["token"].as<String>();
+  }
+  {
+    char json[option_table[OPTION_MQTT].size];
+    StaticJsonDocument<JSON_OBJECT_SIZE(8+2)> doc;
+    DEBUG_PRINT(F("Deserializing MQTT JSON: "));
+    DEBUG_PRINTLN(options[OPTION_MQTT].sval.c_str());
+    parse_option_json(doc, OPTION_MQTT, json);
+    mqtt_config.domain = doc["dmin"].as<String>();
+    mqtt_config.port = doc["port"];
+    mqtt_config.topic = doc["topic"].as<String>();
+    mqtt_config.username = doc["name"].as<String>();
+    mqtt_config.password = doc["pass"].as<String>();
+    mqtt_config.tls = doc["tls"] | 0;
+    mqtt_config.fingerprint = doc["fp"] | "";
+    mqtt_config.persistent = doc["persist"] | 0;
+    mqtt_config.topic_in = mqtt_config.topic + F("/IN/#");
+    mqtt_config.topic_state = mqtt_config.topic + F("/OUT/STATE");
+    mqtt_config.topic_status = mqtt_config.topic + F("/OUT/STATUS");
+    mqtt_config.topic_notify = mqtt_config.topic + F("/OUT/NOTIFY");
+    mqtt_config.topic_command = mqtt_config.topic + F("/OUT/COMMAND");
+    mqtt_config.topic_json = mqtt_config.topic + F("/OUT/JSON");
+    mqtt_config.topic_result = mqtt_config.topic + F("/OUT/RESULT");
+    mqtt_config.topic_event = mqtt_config.topic + F("/OUT/EVENT");
+  }
+  {
+    char json[option_table[OPTION_IFTT].size];
+    StaticJsonDocument<JSON_OBJECT_SIZE(2+2)> doc;
+    DEBUG_PRINT(F("Deserializing IFTTT JSON: "));
+    DEBUG_PRINTLN(options[OPTION_IFTT].sval.c_str());
+    parse_option_json(doc, OPTION_IFTT, json);
+    ifttt_config.token = doc["token"].as<String>();
+    ifttt_config.trigger = doc["trigger"].as<String>();
+  }
+}
+
+uint32_t OpenGarage::crc32(const void *data, size_t len, uint32_t crc) {
+  const byte *p = (const byte*)data;
+  crc = ~crc;
+  while(len--) {
+    crc ^= *p++;
+    for(byte k=0;k<8;k++) crc = (crc>>1) ^ (0xEDB88320 & (0-(crc&1)));
+  }
+  return ~crc;
+}
+
@@ -0,0 +1,107 @@
+/* OpenGarage Firmware
+ *
+ * MQTT outbox
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "outbox.h"
+
+uint  Outbox::head = 0;
+uint  Outbox::count = 0;
+ulong Outbox::dropped = 0;
+
+static const char* outbox_fname = OUTBOX_FNAME;
+
+#define OUTBOX_HEADER_SIZE (2*sizeof(uint))
+
+void Outbox::begin() {
+  head = 0;
+  count = 0;
+  File file = SPIFFS.open(outbox_fname, "r");
+  if(!file) return;
+  uint h[2];
+  if(file.readBytes((char*)h, sizeof(h)) == sizeof(h) && h[0]<OUTBOX_SIZE && h[1]<=OUTBOX_SIZE) {
+    head = h[0];
+    count = h[1];
+  }
+  file.close();
+}
+
+bool Outbox::save_header(File& file) {
+  uint h[2] = {head, count};
+  file.seek(0, SeekSet);
+  return file.write((const byte*)h, sizeof(h)) == sizeof(h);
+}
+
+bool Outbox::push(byte type, ulong tstamp, const char *msg) {
+  File file = SPIFFS.open(outbox_fname, "r+");
+  if(!file) {  // create the outbox file at full size
+    file = SPIFFS.open(outbox_fname, "w");
+    if(!file) return false;
+    head = 0;
+    count = 0;
+    save_header(file);
+    OutboxStruct r;
+    memset(&r, 0, sizeof(r));
+    for(uint i=0;i<OUTBOX_SIZE;i++) {
+      file.write((const byte*)&r, sizeof(r));
+    }
+  }
+  if(count==OUTBOX_SIZE) {  // full, drop the oldest record
+    head = (head+1)%OUTBOX_SIZE;
+    count--;
+    dropped++;
+  }
+  OutboxStruct r;
+  memset(&r, 0, sizeof(r));
+  r.tstamp = tstamp;
+  r.type = type;
+  strncpy(r.msg, msg, OUTBOX_MSG_SIZE-1);
+  file.seek(OUTBOX_HEADER_SIZE+((head+count)%OUTBOX_SIZE)*sizeof(OutboxStruct), SeekSet);
+  file.write((const byte*)&r, sizeof(r));
+  // the header goes last so an interrupted write leaves the old ring
+  count++;
+  save_header(file);
+  file.close();
+  return true;
+}
+
+bool Outbox::peek(OutboxStruct& r) {
+  if(!count) return false;
+  File file = SPIFFS.open(outbox_fname, "r");
+  if(!file) {
+    count = 0;
+    return false;
+  }
+  bool ok = file.seek(OUTBOX_HEADER_SIZE+head*sizeof(OutboxStruct), SeekSet) &&
+            file.readBytes((char*)&r, sizeof(r)) == sizeof(r);
+  file.close();
+  r.msg[OUTBOX_MSG_SIZE-1] = 0;
+  return ok;
+}
+
+void Outbox::pop() {
+  if(!count) return;
+  head = (head+1)%OUTBOX_SIZE;
+  count--;
+  File file = SPIFFS.open(outbox_fname, "r+");
+  if(!file) return;
+  save_header(file);
+  file.close();
+}
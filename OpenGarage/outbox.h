@@ -0,0 +1,57 @@
+/* OpenGarage Firmware
+ *
+ * MQTT outbox header file
+ * Mar 2016 @ OpenGarage.io
+ *
+ * This file is part of the OpenGarage library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OUTBOX_H
+#define _OUTBOX_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "defines.h"
+
+struct OutboxStruct {
+  ulong tstamp;               // time of the event
+  byte type;                  // OUTBOX_DOOR or OUTBOX_NOTIFY
+  char msg[OUTBOX_MSG_SIZE];  // null terminated
+};
+
+/* Ring buffer of events in flash, for events that could not be
+ * published. The file holds the ring head and count followed by
+ * OUTBOX_SIZE records, when it is full the oldest record is dropped.
+ * Records survive a reboot and are read back in the order they
+ * were added. */
+class Outbox {
+public:
+  static void begin();
+  static bool push(byte type, ulong tstamp, const char *msg);
+  static bool peek(OutboxStruct& r);  // oldest record
+  static void pop();
+  static uint size() { return count; }
+  static ulong get_dropped() { return dropped; }
+private:
+  static bool save_header(File& file);
+  static uint head;   // ring index of the oldest record
+  static uint count;
+  static ulong dropped;
+};
+
+#endif  // _OUTBOX_H
@@ -0,0 +1,88 @@
+/* Config access in the main loop. Every connected loop pass checks the
+ * MQTT domain; get_mqtt_config() used to deserialize the MQTT option and
+ * build five Strings for that, now it returns the copy parsed when the
+ * options are loaded. The old accessor is kept below as it was, running
+ * on the ArduinoJson stand-in, so the parse time is only indicative while
+ * the heap churn follows the ESP8266 String. */
+#include <assert.h>
+#include <chrono>
+#include "OpenGarage.h"
+
+MqttStruct OpenGarage::mqtt_config;
+
+#define PASSES 200000
+
+static const char *mqtt_json = "{\"dmin\":\"broker.example.com\",\"port\":1883,\"topic\":\"garage\",\"name\":\"opengarage\",\"pass\":\"secret-password\"}";
+static String mqtt_sval;  // options[OPTION_MQTT].sval was a String
+
+struct OldMqttStruct {
+  String domain;
+  uint port;
+  String username;
+  String password;
+  String topic;
+};
+
+static OldMqttStruct old_get_mqtt_config() {
+  StaticJsonDocument<(JSON_OBJECT_SIZE(5) + 128)> doc;
+  deserializeJson(doc, mqtt_sval);
+  OldMqttStruct mqtt_config;
+
+  mqtt_config.domain = doc["dmin"].as<String>();
+  mqtt_config.port = doc["port"];
+  mqtt_config.topic = doc["topic"].as<String>();
+  mqtt_config.username = doc["name"].as<String>();
+  mqtt_config.password = doc["pass"].as<String>();
+  return mqtt_config;
+}
+
+struct Result {
+  double passes_per_s;
+  double allocs;  // per pass
+  double bytes;   // per pass
+};
+
+template<class F>
+static Result run(F pass) {
+  HostHeap h0 = host_heap;
+  uint n = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for(uint i=0;i<PASSES;i++) {
+    n += pass();
+    asm volatile("" ::: "memory");  // keep the passes from being folded
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  assert(n == PASSES);
+  assert(host_heap.live == h0.live);
+  Result r;
+  r.passes_per_s = PASSES/std::chrono::duration<double>(t1-t0).count();
+  r.allocs = (double)(host_heap.allocs-h0.allocs)/PASSES;
+  r.bytes = (double)(host_heap.bytes-h0.bytes)/PASSES;
+  return r;
+}
+
+int main() {
+  mqtt_sval = mqtt_json;
+  assert(old_get_mqtt_config().domain == "broker.example.com");
+  assert(old_get_mqtt_config().port == 1883);
+
+  // what parse_configs() leaves behind
+  MqttStruct& cfg = const_cast<MqttStruct&>(OpenGarage::get_mqtt_config());
+  cfg.domain = old_get_mqtt_config().domain;
+
+  Result before = run([]() { return old_get_mqtt_config().domain.length()>8; });
+  Result after = run([]() { return OpenGarage::get_mqtt_config().domain.length()>8; });
+
+  printf("config: MQTT domain check per loop pass\n");
+  printf("  parsed on every call  %10.0f passes/s  %4.1f allocs  %5.1f bytes per pass\n",
+         before.passes_per_s, before.allocs, before.bytes);
+  printf("  cached at load        %10.0f passes/s  %4.1f allocs  %5.1f bytes per pass\n",
+         after.passes_per_s, after.allocs, after.bytes);
+  // domain and password do not fit inline, each is built as a temporary and copied
+  assert(before.allocs >= 4);
+  assert(after.allocs == 0 && after.bytes == 0);
+  assert(after.passes_per_s > before.passes_per_s);
+
+  printf("bench_config: ok\n");
+  return 0;
+}
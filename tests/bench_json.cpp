@@ -0,0 +1,185 @@
+/* Building the /jc and /jl responses: with String appends as before
+ * JsonWriter, and streamed through JsonWriter into the response body.
+ * The String builders are kept below as they were, with the controller
+ * state in plain variables. Heap use follows the ESP8266 String; the
+ * response body reserves its memory up front so that only the builders
+ * are counted. */
+#include <assert.h>
+#include <chrono>
+#include "OpenGarage.h"
+#include "jsonwriter.h"
+
+#define RESPONSES 20000
+#define LOG_RECORDS 100
+
+static uint distance = 123;
+static byte door_status = 1, vehicle_status = 2;
+static uint read_cnt = 4567;
+static uint fwv = 123;
+static String name = "My OpenGarage";
+static String mac = "5C:CF:7F:01:02:03";
+static ulong cid = 1234567;
+static int16_t rssi = -61;
+static float tempC = 21.5f, humid = 48.25f;
+static byte otcs = 3;
+static ulong otcc = 1700000000UL, curr_utc_time = 1700000100UL;
+static LogStruct logs[LOG_RECORDS];
+
+static void old_controller_json(String& json) {
+  json = "";
+  json += F("{\"dist\":");
+  json += distance;
+  json += F(",\"door\":");
+  json += door_status;
+  json += F(",\"vehicle\":");
+  json += vehicle_status;
+  json += F(",\"rcnt\":");
+  json += read_cnt;
+  json += F(",\"fwv\":");
+  json += fwv;
+  json += F(",\"name\":\"");
+  json += name;
+  json += F("\",\"mac\":\"");
+  json += mac;
+  json += F("\",\"cid\":");
+  json += cid;
+  json += F(",\"rssi\":");
+  json += (int)rssi;
+  json += F(",\"temp\":");
+  json += tempC;
+  json += F(",\"humid\":");
+  json += humid;
+  json += F(",\"otcs\":");
+  json += otcs;
+  json += F(",\"otcc\":");
+  json += otcc;
+  json += F("}");
+}
+
+static void new_controller_json(JsonWriter& w) {
+  w.begin_object();
+  w.member(F("dist"), distance);
+  w.member(F("door"), door_status);
+  w.member(F("vehicle"), vehicle_status);
+  w.member(F("rcnt"), read_cnt);
+  w.member(F("fwv"), fwv);
+  w.member(F("name"), name.c_str());
+  w.member(F("mac"), mac);
+  w.member(F("cid"), cid);
+  w.member(F("rssi"), rssi);
+  w.member(F("temp"), tempC);
+  w.member(F("humid"), humid);
+  w.member(F("otcs"), otcs);
+  w.member(F("otcc"), otcc);
+  w.end_object();
+}
+
+static void old_logs_json(String& json) {
+  json = "";
+  json += F("{\"name\":\"");
+  json += name;
+  json += F("\",\"time\":");
+  json += curr_utc_time;
+  json += F(",\"logs\":[");
+  for(uint i=0;i<LOG_RECORDS;i++) {
+    const LogStruct& l = logs[i];
+    json += F("[");
+    json += l.tstamp;
+    json += F(",");
+    json += l.status;
+    json += F(",");
+    json += l.dist;
+    json += F("],");
+  }
+  json.remove(json.length()-1); // remove the extra ,
+  json += F("]}");
+}
+
+static void new_logs_json(JsonWriter& w) {
+  w.begin_object();
+  w.member(F("name"), name.c_str());
+  w.member(F("time"), curr_utc_time);
+  w.key(F("logs"));
+  w.begin_array();
+  for(uint i=0;i<LOG_RECORDS;i++) {
+    w.begin_array();
+    w.value(logs[i].tstamp);
+    w.value(logs[i].status);
+    w.value(logs[i].dist);
+    w.end_array();
+  }
+  w.end_array();
+  w.end_object();
+}
+
+struct Result {
+  double us;      // per response
+  double allocs;  // per response
+  double bytes;   // per response
+  std::string body;
+};
+
+template<class F>
+static Result run(F respond) {
+  OTF::Response res;
+  res.body.reserve(1<<16);
+  HostHeap h0 = host_heap;
+  auto t0 = std::chrono::steady_clock::now();
+  for(uint i=0;i<RESPONSES;i++) {
+    res.body.clear();
+    respond(res);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  assert(host_heap.live == h0.live);
+  Result r;
+  r.us = std::chrono::duration<double, std::micro>(t1-t0).count()/RESPONSES;
+  r.allocs = (double)(host_heap.allocs-h0.allocs)/RESPONSES;
+  r.bytes = (double)(host_heap.bytes-h0.bytes)/RESPONSES;
+  r.body = res.body;
+  return r;
+}
+
+static void report(const char *what, const Result& before, const Result& after) {
+  printf("json: %s response, %u bytes\n", what, (uint)after.body.size());
+  printf("  String appends  %6.2f us  %5.1f allocs  %6.0f bytes allocated\n", before.us, before.allocs, before.bytes);
+  printf("  JsonWriter      %6.2f us  %5.1f allocs  %6.0f bytes allocated\n", after.us, after.allocs, after.bytes);
+}
+
+int main() {
+  for(uint i=0;i<LOG_RECORDS;i++) {
+    logs[i].tstamp = curr_utc_time-(LOG_RECORDS-i)*3600;
+    logs[i].status = i&1;
+    logs[i].dist = 20+i;
+  }
+
+  Result before = run([](OTF::Response& res) {
+    String json;
+    old_controller_json(json);
+    res.writeBodyChunk((char *) "%s", json.c_str());
+  });
+  Result after = run([](OTF::Response& res) {
+    JsonWriter w(res);
+    new_controller_json(w);
+  });
+  report("/jc", before, after);
+  assert(before.body == after.body);
+  assert(before.allocs > 0);
+  assert(after.allocs == 0);
+
+  before = run([](OTF::Response& res) {
+    String json;
+    old_logs_json(json);
+    res.writeBodyChunk((char *) "%s", json.c_str());
+  });
+  after = run([](OTF::Response& res) {
+    JsonWriter w(res);
+    new_logs_json(w);
+  });
+  report("/jl", before, after);
+  assert(before.body == after.body);
+  assert(before.allocs > 0);
+  assert(after.allocs == 0);
+
+  printf("bench_json: ok\n");
+  return 0;
+}
@@ -0,0 +1,143 @@
+/* Flash traffic of the log: write calls and bytes per 1000 door
+ * events with RAM staging, against flushing every record, on a RAM
+ * backed SPIFFS. Also checks that records survive the round trip, that
+ * a failing file system cannot overrun the staging buffer, and that a
+ * flush whose writes fail keeps its records staged. */
+#include <assert.h>
+#include "OpenGarage.h"
+
+OptionStruct OpenGarage::options[NUM_OPTIONS];
+char OptionString::empty[1] = "";
+byte OpenGarage::dirty_bits = 0xFF;
+
+#define EVENTS 1000
+
+static void fresh_log() {
+  SPIFFS.format();
+  OpenGarage::log_setup();
+  host_fs_stats = HostFsStats();
+}
+
+static LogStruct make_log(ulong t) {
+  LogStruct l;
+  l.tstamp = t;
+  l.status = t&1;
+  l.dist = t%400;
+  return l;
+}
+
+// writes EVENTS records spaced gap ms apart, flushing each one if unstaged
+static HostFsStats run(ulong gap, bool unstaged) {
+  fresh_log();
+  for(ulong t=1;t<=EVENTS;t++) {
+    OpenGarage::write_log(make_log(t));
+    if(unstaged) OpenGarage::log_flush();
+    host_advance(gap);
+    OpenGarage::log_process();
+  }
+  host_advance(LOG_FLUSH_INTERVAL);
+  OpenGarage::log_process();
+  return host_fs_stats;
+}
+
+// the newest n records read back newest first
+static void check_tail(ulong newest, uint n) {
+  LogStruct l;
+  assert(OpenGarage::read_log_start());
+  for(uint i=0;i<n;i++) {
+    assert(OpenGarage::read_log_next(l));
+    assert(l.tstamp == newest-i);
+    assert(l.dist == (newest-i)%400);
+  }
+  OpenGarage::read_log_end();
+}
+
+static void bench() {
+  struct { const char *name; ulong gap; bool unstaged; } cases[] = {
+    {"every record flushed", 1000, true},
+    {"staged, 1 s apart   ", 1000, false},
+    {"staged, 30 s apart  ", 30000, false},
+  };
+  printf("log: flash traffic per %d events\n", EVENTS);
+  ulong unstaged_writes = 0;
+  for(auto& c : cases) {
+    ulong ev0 = OpenGarage::get_log_stats().events;
+    HostFsStats st = run(c.gap, c.unstaged);
+    assert(OpenGarage::get_log_stats().events-ev0 == EVENTS);
+    check_tail(EVENTS, DEFAULT_LOG_SIZE);
+    printf("  %s  %6lu writes  %7lu bytes  %4lu opens\n", c.name, st.writes, st.bytes, st.opens);
+    if(c.unstaged) unstaged_writes = st.writes;
+    else if(c.gap*LOG_STAGE_SIZE <= LOG_FLUSH_INTERVAL) assert(st.writes < unstaged_writes);
+    else assert(st.writes <= unstaged_writes);  // sparse events are flushed one by one
+  }
+}
+
+static void failing_fs() {
+  fresh_log();
+  const LogStatStruct& ls = OpenGarage::get_log_stats();
+  ulong dropped = ls.dropped;
+  host_fs_fail = true;
+  for(ulong t=1;t<=3*LOG_STAGE_SIZE;t++) {
+    OpenGarage::write_log(make_log(t));
+    host_advance(LOG_FLUSH_INTERVAL);
+    OpenGarage::log_process();
+  }
+  // the staging buffer keeps the newest records, the rest are counted
+  assert(ls.dropped-dropped == 2*LOG_STAGE_SIZE);
+  LogStruct l;
+  uint n = 0;
+  OpenGarage::read_log_start();
+  while(OpenGarage::read_log_next(l)) assert(l.tstamp == 3*LOG_STAGE_SIZE-n++);
+  OpenGarage::read_log_end();
+  assert(n == LOG_STAGE_SIZE);
+  // once the file system is back the staged records are written
+  host_fs_fail = false;
+  host_advance(LOG_FLUSH_INTERVAL);
+  OpenGarage::log_process();
+  assert(host_fs_stats.writes > 0);
+  check_tail(3*LOG_STAGE_SIZE, LOG_STAGE_SIZE);
+  printf("log: %lu records dropped while the file system failed, staging bounded\n", ls.dropped-dropped);
+}
+
+static void failed_flush() {
+  fresh_log();
+  const LogStatStruct& ls = OpenGarage::get_log_stats();
+  for(ulong t=1;t<=LOG_STAGE_SIZE;t++) OpenGarage::write_log(make_log(t));
+  ulong flushes = ls.flushes;
+  for(ulong t=LOG_STAGE_SIZE+1;t<=LOG_STAGE_SIZE+3;t++) OpenGarage::write_log(make_log(t));
+
+  // the records go out, the header write fails
+  host_fs_writes_left = 1;
+  host_advance(LOG_FLUSH_INTERVAL);
+  OpenGarage::log_process();
+  assert(host_fs_writes_left == 0);
+  assert(ls.flushes == flushes);
+  check_tail(LOG_STAGE_SIZE+3, LOG_STAGE_SIZE+3);  // nothing read twice
+
+  // retried only after another interval, the records fail this time
+  ulong writes = host_fs_stats.writes;
+  OpenGarage::log_process();
+  assert(host_fs_stats.writes == writes);
+  host_advance(LOG_FLUSH_INTERVAL);
+  OpenGarage::log_process();
+  assert(ls.flushes == flushes);
+  check_tail(LOG_STAGE_SIZE+3, LOG_STAGE_SIZE+3);
+
+  host_fs_writes_left = -1;
+  host_advance(LOG_FLUSH_INTERVAL);
+  OpenGarage::log_process();
+  assert(ls.flushes == flushes+1);
+  check_tail(LOG_STAGE_SIZE+3, LOG_STAGE_SIZE+3);
+  OpenGarage::log_setup();  // the header on file agrees
+  check_tail(LOG_STAGE_SIZE+3, LOG_STAGE_SIZE+3);
+  printf("log: failed flush kept its records staged until a later flush succeeded\n");
+}
+
+int main() {
+  OpenGarage::options[OPTION_LSZ].ival = DEFAULT_LOG_SIZE;
+  bench();
+  failing_fs();
+  failed_flush();
+  printf("bench_log: ok\n");
+  return 0;
+}
@@ -0,0 +1,214 @@
+/* Boot-time config load from the RAM file system stand-in: the text file
+ * of earlier firmwares, which is read line by line and migrated on the
+ * first boot, against the binary image read in one go. Also checks that
+ * a burst of option changes costs one write, that a failed write keeps
+ * the changes pending until a later write succeeds, and compares the
+ * memory of the option arena with the heap Strings it replaced. */
+#include <assert.h>
+#include <chrono>
+#include "OpenGarage.h"
+
+byte OpenGarage::dirty_bits;
+
+#define BOOTS 2000
+
+typedef OpenGarage og;
+
+// the config as earlier firmwares wrote it, one name:value line per option
+static void write_text_config() {
+  String txt;
+  for(byte i=0;i<NUM_OPTIONS;i++) {
+    txt += og::option_name(i);
+    txt += ':';
+    if(og::option_max(i)) txt += og::options[i].ival;
+    else if(og::option_flags(i) & OPTION_FLAG_IP) {
+      uint v = og::options[i].ival;
+      char ip[16];
+      if(v) snprintf(ip, sizeof(ip), "%u.%u.%u.%u", v&0xFF, (v>>8)&0xFF, (v>>16)&0xFF, v>>24);
+      else strcpy(ip, "-.-.-.-");
+      txt += ip;
+    } else txt += og::options[i].sval.c_str();
+    txt += "\r\n";
+  }
+  File f = SPIFFS.open(CONFIG_TXT_FNAME, "w");
+  f.write((const uint8_t*)txt.c_str(), txt.length());
+  f.close();
+}
+
+struct Result {
+  double us;      // per boot
+  double allocs;  // per boot
+  double opens;   // per boot
+};
+
+template<class F>
+static Result boot(F prepare) {
+  Result r = {0, 0, 0};
+  for(uint i=0;i<BOOTS;i++) {
+    prepare();
+    HostHeap h0 = host_heap;
+    HostFsStats f0 = host_fs_stats;
+    auto t0 = std::chrono::steady_clock::now();
+    og::options_setup();
+    auto t1 = std::chrono::steady_clock::now();
+    r.us += std::chrono::duration<double, std::micro>(t1-t0).count();
+    r.allocs += host_heap.allocs-h0.allocs;
+    r.opens += host_fs_stats.opens-f0.opens;
+  }
+  r.us /= BOOTS;
+  r.allocs /= BOOTS;
+  r.opens /= BOOTS;
+  return r;
+}
+
+static void load_bench() {
+  og::options_setup();  // defaults
+  og::options[OPTION_RIV].ival = 17;
+  og::options[OPTION_NAME].sval = "Garage door";
+  og::options[OPTION_MQTT].sval = "{\"dmin\":\"broker.example.com\",\"port\":1883,\"name\":\"og\",\"pass\":\"secret\",\"topic\":\"garage\"}";
+  og::options[OPTION_DVIP].ival = OPTION_IP(192,168,1,20);
+  write_text_config();
+  SPIFFS.remove(CONFIG_FNAME);
+
+  Result text = boot([]() { SPIFFS.remove(CONFIG_FNAME); write_text_config(); });
+  assert(og::options[OPTION_RIV].ival == 17);
+  assert(og::get_mqtt_config().domain == "broker.example.com");
+  assert(og::options[OPTION_DVIP].ival == OPTION_IP(192,168,1,20));
+  assert(!SPIFFS.exists(CONFIG_TXT_FNAME) && SPIFFS.exists(CONFIG_FNAME));
+
+  Result bin = boot([]() {});
+  assert(og::options[OPTION_RIV].ival == 17);
+  assert(!strcmp(og::options[OPTION_NAME].sval.c_str(), "Garage door"));
+
+  printf("options: boot-time config load, %d options\n", NUM_OPTIONS);
+  printf("  text, migrated  %6.2f us  %5.1f allocs  %3.1f opens per boot\n", text.us, text.allocs, text.opens);
+  printf("  binary image    %6.2f us  %5.1f allocs  %3.1f opens per boot\n", bin.us, bin.allocs, bin.opens);
+  assert(bin.opens == 1);
+  assert(bin.us < text.us);
+}
+
+static void coalesced_writes() {
+  og::options_flush();
+  ulong opens = host_fs_stats.opens;
+  for(int i=0;i<10;i++) {
+    og::options[OPTION_RIV].ival = 20+i;
+    og::options_save();
+    host_advance(CONFIG_SAVE_DELAY/4);
+    og::options_process();
+  }
+  assert(host_fs_stats.opens == opens);
+  host_advance(CONFIG_SAVE_DELAY);
+  og::options_process();
+  assert(host_fs_stats.opens == opens+1);
+  og::options_setup();
+  assert(og::options[OPTION_RIV].ival == 29);
+  printf("options: 10 changes written with 1 file write\n");
+}
+
+static void failed_write() {
+  og::options[OPTION_RIV].ival = 42;
+  og::options_save();
+
+  // the write fails, the change stays pending
+  host_fs_writes_left = 0;
+  host_advance(CONFIG_SAVE_DELAY);
+  ulong opens = host_fs_stats.opens;
+  og::options_process();
+  assert(host_fs_stats.opens == opens+1);
+  host_fs_writes_left = -1;
+
+  // retried only after another delay
+  og::options_process();
+  assert(host_fs_stats.opens == opens+1);
+
+  // the file system cannot be opened either
+  host_fs_fail = true;
+  host_advance(CONFIG_SAVE_DELAY);
+  og::options_process();
+  host_fs_fail = false;
+
+  host_advance(CONFIG_SAVE_DELAY);
+  og::options_process();
+  assert(host_fs_stats.opens == opens+2);
+  host_advance(CONFIG_SAVE_DELAY);
+  og::options_process();
+  assert(host_fs_stats.opens == opens+2);  // nothing left to write
+
+  og::options[OPTION_RIV].ival = 0;
+  og::options_setup();
+  assert(og::options[OPTION_RIV].ival == 42);
+  printf("options: failed write retried until it succeeded\n");
+}
+
+// how options were kept before the arena, name and value as heap Strings
+struct OldOptionStruct {
+  String name;
+  uint ival;
+  uint max;
+  String sval;
+};
+
+// heap used by the current option values in the old layout, IPs as dotted
+// strings, or with every string option as long as its slot allows now
+static void old_heap(const char *what, bool full=false) {
+  HostHeap h0 = host_heap;
+  OldOptionStruct old[NUM_OPTIONS];
+  for(byte i=0;i<NUM_OPTIONS;i++) {
+    old[i].name = og::option_name(i);
+    old[i].max = og::option_max(i);
+    old[i].ival = og::options[i].ival;
+    if(og::option_flags(i) & OPTION_FLAG_IP) {
+      uint v = og::options[i].ival;
+      char ip[16];
+      if(v) snprintf(ip, sizeof(ip), "%u.%u.%u.%u", v&0xFF, (v>>8)&0xFF, (v>>16)&0xFF, v>>24);
+      else strcpy(ip, "-.-.-.-");
+      old[i].sval = ip;
+    } else if(full && !og::option_max(i)) {
+      char v[CONFIG_MAX_SIZE];
+      uint n = og::options[i].sval.capacity();
+      memset(v, 'x', n);
+      v[n] = 0;
+      old[i].sval = v;
+    } else if(!og::option_max(i)) old[i].sval = og::options[i].sval.c_str();
+  }
+  HostHeap h1 = host_heap;
+  printf("  heap Strings  %5u bytes static  %3ld heap blocks  %5lu heap bytes  (%s)\n",
+         (uint)sizeof(old), h1.live-h0.live, h1.bytes-h0.bytes, what);
+}
+
+static void memory() {
+  og::options_setup();
+  uint arena = 0;
+  OptionInfo info;
+  for(byte i=0;i<NUM_OPTIONS;i++) {
+    og::option_info(i, info);
+    arena += info.size;
+  }
+
+  printf("options: memory of %d options (host sizes)\n", NUM_OPTIONS);
+  old_heap("current values");
+  old_heap("slot-sized values", true);
+
+  // values of any length up to the slot size never touch the heap
+  for(byte i=0;i<NUM_OPTIONS;i++) {
+    if(og::option_max(i) || (og::option_flags(i) & OPTION_FLAG_IP)) continue;
+    String v;
+    while(v.length() < og::options[i].sval.capacity()) v += 'x';
+    ulong allocs = host_heap.allocs;
+    og::options[i].sval = v;
+    assert(host_heap.allocs == allocs);
+    assert(og::options[i].sval.length() == og::options[i].sval.capacity());
+  }
+  uint table = sizeof(OptionStruct)*NUM_OPTIONS;
+  printf("  option arena  %5u bytes static    0 heap blocks      0 heap bytes  (%u options[] + %u arena)\n",
+         table+arena, table, arena);
+}
+
+int main() {
+  load_bench();
+  coalesced_writes();
+  failed_write();
+  memory();
+  printf("bench_options: ok\n");
+  return 0;
+}
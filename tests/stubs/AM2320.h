@@ -0,0 +1,3 @@
+/* Host build stand-in, the tests do not use AM2320 */
+#pragma once
+class AM2320;
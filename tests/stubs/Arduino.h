@@ -0,0 +1,163 @@
+/* Host build stand-in for the parts of the Arduino core the tests use.
+ * millis() runs off a clock the test advances with host_advance(). */
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define HIGH 1
+#define LOW  0
+
+class __FlashStringHelper;
+#define F(s)      ((const __FlashStringHelper*)(s))
+#define FPSTR(p)  ((const __FlashStringHelper*)(p))
+#define PSTR(s)   (s)
+#define PGM_P     const char *
+#define pgm_read_byte(p)  (*(const uint8_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define strncpy_P strncpy
+#define memcpy_P  memcpy
+#define strlen_P  strlen
+#define strncmp_P strncmp
+
+inline char* ltoa(long v, char *buf, int base) { snprintf(buf, 24, base==16 ? "%lx" : "%ld", v); return buf; }
+inline char* ultoa(unsigned long v, char *buf, int base) { snprintf(buf, 24, base==16 ? "%lx" : "%lu", v); return buf; }
+inline char* dtostrf(double v, signed char width, unsigned char prec, char *buf) { sprintf(buf, "%*.*f", width, prec, v); return buf; }
+
+unsigned long millis();
+unsigned long micros();
+void host_advance(unsigned long ms);
+inline void delay(unsigned long ms) { host_advance(ms); }
+inline long random(long n) { return n>0 ? rand()%n : 0; }
+inline int  digitalRead(uint8_t) { return 0; }
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline void pinMode(uint8_t, uint8_t) {}
+
+/* Heap use of the host build: every malloc/realloc made by String
+ * and every operator new is counted here. */
+struct HostHeap {
+  unsigned long allocs;  // allocations and reallocations
+  unsigned long bytes;   // bytes requested by them
+  long live;             // blocks currently allocated
+};
+extern HostHeap host_heap;
+void *host_malloc(size_t n);
+void *host_realloc(void *p, size_t n);
+void host_free(void *p);
+
+/* Follows the ESP8266 core String: strings up to 10 chars are kept
+ * inline, longer ones on the heap in blocks rounded up to 16 bytes. */
+class String {
+public:
+  String(const char *s="") : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this = s; }
+  String(const __FlashStringHelper *s) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this = (const char*)s; }
+  String(const String& o) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this = o.c_str(); }
+  explicit String(int v) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this += v; }
+  explicit String(unsigned int v) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this += v; }
+  explicit String(long v) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this += v; }
+  explicit String(unsigned long v) : buf(NULL), cap(SSO_CAP), len(0) { sso[0] = 0; *this += v; }
+  ~String() { if(buf) host_free(buf); }
+  const char* c_str() const { return buf ? buf : sso; }
+  unsigned int length() const { return len; }
+  bool reserve(unsigned int n) {
+    if(n<=cap) return true;
+    size_t size = (n+16) & ~(size_t)15;
+    char *b = (char*)(buf ? host_realloc(buf, size) : host_malloc(size));
+    if(!buf) memcpy(b, sso, len+1);
+    buf = b;
+    cap = size-1;
+    return true;
+  }
+  String& operator=(const String& o) { return o.c_str()==c_str() ? *this : (*this = o.c_str()); }
+  String& operator=(const char *s) { len = 0; (buf ? buf : sso)[0] = 0; return append(s ? s : "", s ? strlen(s) : 0); }
+  String& operator=(const __FlashStringHelper *s) { return *this = (const char*)s; }
+  bool operator==(const String& o) const { return !strcmp(c_str(), o.c_str()); }
+  bool operator!=(const String& o) const { return !(*this == o); }
+  bool operator==(const char *o) const { return !strcmp(c_str(), o); }
+  long toInt() const { return atol(c_str()); }
+  void trim() {
+    const char *s = c_str();
+    unsigned int b = 0, e = len;
+    while(b<e && isspace((unsigned char)s[b])) b++;
+    while(e>b && isspace((unsigned char)s[e-1])) e--;
+    char *d = buf ? buf : sso;
+    memmove(d, d+b, e-b);
+    len = e-b;
+    d[len] = 0;
+  }
+  void remove(unsigned int index) { if(index<len) { len = index; (buf ? buf : sso)[len] = 0; } }
+  String& operator+=(const String& o) { return append(o.c_str(), o.length()); }
+  String& operator+=(const char *o) { return append(o, strlen(o)); }
+  String& operator+=(const __FlashStringHelper *o) { return *this += (const char*)o; }
+  String& operator+=(char c) { return append(&c, 1); }
+  String& operator+=(int v) { char b[16]; snprintf(b, sizeof(b), "%d", v); return *this += b; }
+  String& operator+=(unsigned int v) { char b[16]; snprintf(b, sizeof(b), "%u", v); return *this += b; }
+  String& operator+=(long v) { char b[24]; snprintf(b, sizeof(b), "%ld", v); return *this += b; }
+  String& operator+=(unsigned long v) { char b[24]; snprintf(b, sizeof(b), "%lu", v); return *this += b; }
+  String& operator+=(float v) { char b[24]; snprintf(b, sizeof(b), "%.2f", v); return *this += b; }
+  friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const char *b) { String r(a); r += b; return r; }
+  friend String operator+(const char *a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const __FlashStringHelper *b) { String r(a); r += b; return r; }
+private:
+  enum { SSO_CAP = 10 };
+  String& append(const char *s, size_t n) {
+    reserve(len+n);
+    char *d = buf ? buf : sso;
+    memmove(d+len, s, n);
+    len += n;
+    d[len] = 0;
+    return *this;
+  }
+  char *buf;
+  char sso[SSO_CAP+1];
+  unsigned int cap;
+  unsigned int len;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) { return 1; }
+  virtual size_t write(const uint8_t*, size_t n) { return n; }
+  template<typename T> size_t print(const T&) { return 0; }
+  template<typename T> size_t println(const T&) { return 0; }
+  size_t println() { return 0; }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  size_t readBytes(char *buf, size_t n) { size_t i=0; int c; while(i<n && (c=read())>=0) buf[i++]=(char)c; return i; }
+  String readStringUntil(char t) { String s; int c; while((c=read())>=0 && c!=t) s += (char)c; return s; }
+  void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint32_t random() { return (uint32_t)rand(); }
+  void restart() { exit(1); }
+};
+extern EspClass ESP;
+
+#endif  // _HOST_ARDUINO_H
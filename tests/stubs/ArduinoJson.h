@@ -0,0 +1,124 @@
+/* Host build stand-in for ArduinoJson 6, limited to flat objects of
+ * string, number and boolean members as used by the config options.
+ * Like StaticJsonDocument it never touches the heap: keys and values
+ * are copied into the document's own pool unless the input is a
+ * writable char*, which is then used in place (zero-copy mode). */
+#pragma once
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_OBJECT_SIZE(n) ((n)*16)
+
+class DeserializationError {
+public:
+  enum Code { Ok, InvalidInput, NoMemory };
+  DeserializationError(Code c=Ok) : code(c) {}
+  explicit operator bool() const { return code!=Ok; }
+  const char* c_str() const { return code==Ok ? "Ok" : code==NoMemory ? "NoMemory" : "InvalidInput"; }
+private:
+  Code code;
+};
+
+class JsonVariantConst {
+public:
+  JsonVariantConst(const char *v=NULL) : v(v) {}
+  bool isNull() const { return !v; }
+  template<class T> T as() const { return (T)(v ? (!strcmp(v, "true") ? 1 : strtol(v, NULL, 10)) : 0); }
+  template<class T> operator T() const { return as<T>(); }
+  const char* operator|(const char *d) const { return v ? v : d; }
+  int operator|(int d) const { return v ? as<int>() : d; }
+private:
+  const char *v;
+};
+
+template<> inline const char* JsonVariantConst::as<const char*>() const { return v; }
+template<> inline String JsonVariantConst::as<String>() const { return v ? String(v) : String("null"); }
+
+class JsonDocument {
+public:
+  JsonVariantConst operator[](const char *key) const {
+    for(int i=0;i<n;i++)
+      if(!strcmp(keys[i], key)) return JsonVariantConst(vals[i]);
+    return JsonVariantConst();
+  }
+  void clear() { n = 0; used = 0; }
+  DeserializationError parse(char *in, bool in_place);
+protected:
+  JsonDocument(char *pool, size_t size) : pool(pool), size(size), used(0), n(0) {}
+private:
+  enum { MAX_MEMBERS = 24 };
+  char *store(char *s, size_t len, bool in_place);
+  char *pool;
+  size_t size, used;
+  const char *keys[MAX_MEMBERS];
+  const char *vals[MAX_MEMBERS];
+  int n;
+};
+
+template<size_t N>
+class StaticJsonDocument : public JsonDocument {
+public:
+  StaticJsonDocument() : JsonDocument(buf, N) {}
+private:
+  char buf[N];
+};
+
+// Strings are copied to the pool, or terminated in place for a writable input.
+inline char *JsonDocument::store(char *s, size_t len, bool in_place) {
+  if(in_place) { s[len] = 0; return s; }
+  if(used+len+1 > size) return NULL;
+  char *d = pool+used;
+  memcpy(d, s, len);
+  d[len] = 0;
+  used += len+1;
+  return d;
+}
+
+inline DeserializationError JsonDocument::parse(char *in, bool in_place) {
+  clear();
+  char *p = in;
+  while(*p==' ') p++;
+  if(*p++!='{') return DeserializationError::InvalidInput;
+  for(;;) {
+    while(*p==' '||*p==',') p++;
+    if(*p=='}') return DeserializationError();
+    if(*p++!='"') return DeserializationError::InvalidInput;
+    char *k = p;
+    while(*p && *p!='"') p++;
+    if(!*p) return DeserializationError::InvalidInput;
+    char *kend = p++;
+    while(*p==' '||*p==':') p++;
+    char *v = p, *vend;
+    if(*p=='"') {
+      v = ++p;
+      while(*p && *p!='"') p++;
+      if(!*p) return DeserializationError::InvalidInput;
+      vend = p++;
+    } else {
+      while(*p && *p!=',' && *p!='}' && *p!=' ') p++;
+      vend = p;
+    }
+    // members take their slots from the pool like in ArduinoJson
+    if(n==MAX_MEMBERS || (used+=JSON_OBJECT_SIZE(1)) > size) return DeserializationError::NoMemory;
+    // a bare value is ended by its separator, which may be overwritten below
+    char next = vend==p ? *p : 0;
+    const char *key = store(k, kend-k, in_place);
+    const char *val = store(v, vend-v, in_place);
+    if(!key || !val) return DeserializationError::NoMemory;
+    keys[n] = key;
+    vals[n++] = val;
+    if(vend==p) {
+      if(next=='}') return DeserializationError();
+      if(!next) return DeserializationError::InvalidInput;
+      p++;
+    }
+  }
+}
+
+template<size_t N>
+DeserializationError deserializeJson(StaticJsonDocument<N>& doc, char *in) { return doc.parse(in, true); }
+template<size_t N>
+DeserializationError deserializeJson(StaticJsonDocument<N>& doc, const char *in) { return doc.parse((char*)in, false); }
+template<size_t N>
+DeserializationError deserializeJson(StaticJsonDocument<N>& doc, const String& in) { return doc.parse((char*)in.c_str(), false); }
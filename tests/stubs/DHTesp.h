@@ -0,0 +1,3 @@
+/* Host build stand-in, the tests do not use DHTesp */
+#pragma once
+class DHTesp;
@@ -0,0 +1,4 @@
+/* Host build stand-in, the tests do not use the DS18B20 driver */
+#pragma once
+class OneWire;
+class DallasTemperature;
@@ -0,0 +1,106 @@
+/* Host build stand-in for the ESP8266WiFi library. WiFiClient talks
+ * to host_net: connect() succeeds while host_net.connect_ok is set,
+ * sent data is appended to host_net.sent and host_net.reply is what
+ * the peer answers. Calls that fail block for their whole timeout,
+ * host_net.timeout is the last one used. */
+#ifndef _HOST_ESP8266WIFI_H
+#define _HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string>
+
+class IPAddress {
+public:
+  IPAddress(uint32_t a=0) : addr(a) {}
+  operator uint32_t() const { return addr; }
+  bool fromString(const String& s) {
+    unsigned a, b, c, d;
+    char end;
+    if(sscanf(s.c_str(), "%u.%u.%u.%u%c", &a, &b, &c, &d, &end)!=4 || a>255 || b>255 || c>255 || d>255) return false;
+    addr = a | b<<8 | c<<16 | (uint32_t)d<<24;
+    return true;
+  }
+private:
+  uint32_t addr;
+};
+
+struct HostNet {
+  bool connect_ok;
+  bool dns_fail;          // names don't resolve
+  bool mqtt_mute;         // the broker accepts connections but doesn't answer CONNECT
+  uint16_t mfln;          // smallest TLS fragment length the broker accepts, 0 for none
+  unsigned long connects;
+  unsigned long lookups;
+  unsigned long probes;
+  unsigned long timeout;  // ms, of the last blocking call
+  std::string sent;
+  std::string reply;
+};
+extern HostNet host_net;
+
+class WiFiClient : public Stream {
+public:
+  WiFiClient() : open(false), timeout(1000) {}
+  virtual ~WiFiClient() {}
+  virtual int connect(IPAddress, uint16_t) {
+    host_net.connects++;
+    open = host_net.connect_ok;
+    host_net.timeout = timeout;
+    if(!open) host_advance(timeout);
+    return open;
+  }
+  virtual int connect(const char*, uint16_t port) { return WiFiClient::connect(IPAddress(), port); }
+  void setTimeout(unsigned long ms) { timeout = ms; }
+  size_t print(const String& s) { host_net.sent += s.c_str(); return s.length(); }
+  int available() { return open ? (int)host_net.reply.size() : 0; }
+  int read() { return -1; }
+  int read(uint8_t *buf, size_t n) {
+    if(n>host_net.reply.size()) n = host_net.reply.size();
+    memcpy(buf, host_net.reply.data(), n);
+    host_net.reply.erase(0, n);
+    return n;
+  }
+  void stop() { open = false; }
+  uint8_t connected() { return open; }
+private:
+  bool open;
+  unsigned long timeout;
+};
+
+namespace BearSSL {
+class Session {};
+class WiFiClientSecure : public WiFiClient {
+public:
+  WiFiClientSecure() : rx(16384) {}
+  void setInsecure() { fingerprint = ""; }
+  bool setFingerprint(const char *fp) { fingerprint = fp; return true; }
+  void setSession(Session*) {}
+  void setBufferSizes(int recv, int) { rx = recv; }
+  static bool probeMaxFragmentLength(IPAddress, uint16_t, uint16_t len) {
+    host_net.probes++;
+    return host_net.connect_ok && host_net.mfln && len >= host_net.mfln;
+  }
+  std::string fingerprint;
+  int rx;
+};
+}
+
+enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 };
+
+class ESP8266WiFiClass {
+public:
+  ESP8266WiFiClass() : link(WL_CONNECTED) {}
+  int status() { return link; }
+  int link;  // what status() returns
+  int hostByName(const char*, IPAddress& ip, uint32_t ms) {
+    host_net.lookups++;
+    host_net.timeout = ms;
+    if(host_net.dns_fail) { host_advance(ms); return 0; }
+    ip = IPAddress(0x0100007f);
+    return 1;
+  }
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif  // _HOST_ESP8266WIFI_H
@@ -0,0 +1,90 @@
+/* RAM backed stand-in for SPIFFS. Every write() call is counted in
+ * host_fs_stats so tests can measure flash traffic; open() fails
+ * while host_fs_fail is set, write() once host_fs_writes_left write
+ * calls have succeeded. */
+#ifndef _HOST_FS_H
+#define _HOST_FS_H
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+struct HostFsStats {
+  unsigned long opens;
+  unsigned long writes;  // write() calls
+  unsigned long bytes;   // bytes written
+};
+extern HostFsStats host_fs_stats;
+extern bool host_fs_fail;
+extern long host_fs_writes_left;  // write() calls that still succeed, negative for no limit
+
+class File : public Stream {
+public:
+  File() : pos(0) {}
+  File(std::shared_ptr<std::vector<uint8_t>> d) : data(d), pos(0) {}
+  explicit operator bool() const { return (bool)data; }
+  void close() { data.reset(); }
+  bool seek(uint32_t p, SeekMode m=SeekSet) {
+    if(!data) return false;
+    if(m==SeekCur) p += pos; else if(m==SeekEnd) p += data->size();
+    if(p>data->size()) return false;
+    pos = p;
+    return true;
+  }
+  size_t position() const { return pos; }
+  size_t size() const { return data ? data->size() : 0; }
+  int available() { return data ? (int)(data->size()-pos) : 0; }
+  int read() { return (data && pos<data->size()) ? (*data)[pos++] : -1; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t n) {
+    if(!data || !host_fs_writes_left) return 0;
+    if(host_fs_writes_left>0) host_fs_writes_left--;
+    if(pos+n>data->size()) data->resize(pos+n);
+    memcpy(data->data()+pos, buf, n);
+    pos += n;
+    host_fs_stats.writes++;
+    host_fs_stats.bytes += n;
+    return n;
+  }
+  bool flush() { return true; }
+private:
+  std::shared_ptr<std::vector<uint8_t>> data;
+  size_t pos;
+};
+
+class FS {
+public:
+  bool begin() { return true; }
+  File open(const char *name, const char *mode) {
+    if(host_fs_fail) return File();
+    host_fs_stats.opens++;
+    auto it = files.find(name);
+    if(mode[0]=='w') {
+      auto d = std::make_shared<std::vector<uint8_t>>();
+      files[name] = d;
+      return File(d);
+    }
+    if(it==files.end()) return File();
+    return File(it->second);
+  }
+  File open(const String& name, const char *mode) { return open(name.c_str(), mode); }
+  bool exists(const char *name) { return files.count(name)>0; }
+  bool remove(const char *name) { return files.erase(name)>0; }
+  bool rename(const char *from, const char *to) {
+    auto it = files.find(from);
+    if(it==files.end()) return false;
+    files[to] = it->second;
+    files.erase(from);
+    return true;
+  }
+  void format() { files.clear(); }
+private:
+  std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+};
+extern FS SPIFFS;
+
+#endif  // _HOST_FS_H
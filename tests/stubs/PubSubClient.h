@@ -0,0 +1,47 @@
+/* Host build stand-in for PubSubClient, records what is published and
+ * subscribed. connect() answers through the transport set by setClient(),
+ * see host_net in ESP8266WiFi.h. */
+#ifndef _HOST_PUBSUBCLIENT_H
+#define _HOST_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <string>
+#include <vector>
+
+class PubSubClient {
+public:
+  PubSubClient() : up(true), client(NULL), socket_timeout(15) {}
+  PubSubClient& setClient(WiFiClient& c) { client = &c; return *this; }
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setServer(IPAddress, uint16_t) { return *this; }
+  PubSubClient& setSocketTimeout(uint16_t s) { socket_timeout = s; return *this; }
+  PubSubClient& setCallback(void (*)(char*, uint8_t*, unsigned int)) { return *this; }
+  bool connect(const char*, const char*, const char*, const char*, uint8_t, bool, const char*, bool) {
+    up = client && client->connected() && !host_net.mqtt_mute;
+    host_net.timeout = socket_timeout*1000UL;
+    if(!up) host_advance(host_net.timeout);
+    return up;
+  }
+  void disconnect() { up = false; if(client) client->stop(); }
+  bool connected() { return up; }
+  bool subscribe(const char *topic, uint8_t) {
+    if(!up) return false;
+    subscribed.push_back(topic);
+    return true;
+  }
+  bool publish(const char *topic, const char *payload) {
+    if(!up) return false;
+    published.push_back(std::string(topic)+" "+payload);
+    return true;
+  }
+  bool publish(const char *topic, const char *payload, bool) { return publish(topic, payload); }
+  bool up;
+  std::vector<std::string> published;
+  std::vector<std::string> subscribed;
+private:
+  WiFiClient *client;
+  uint16_t socket_timeout;  // s
+};
+
+#endif  // _HOST_PUBSUBCLIENT_H
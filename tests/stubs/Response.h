@@ -0,0 +1,27 @@
+/* Host build stand-in for the OpenThingsFramework response, the body
+ * chunks are appended to body */
+#ifndef _HOST_RESPONSE_H
+#define _HOST_RESPONSE_H
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <string>
+
+namespace OTF {
+class Response {
+public:
+  void writeBodyChunk(const char *fmt, ...) {
+    static char buf[8192];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    body += buf;
+    chunks++;
+  }
+  std::string body;
+  unsigned long chunks = 0;
+};
+}
+
+#endif  // _HOST_RESPONSE_H
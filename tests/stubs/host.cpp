@@ -0,0 +1,48 @@
+/* Globals of the host build stand-ins */
+#include <Arduino.h>
+#include <FS.h>
+#include <ESP8266WiFi.h>
+
+#include <new>
+
+static unsigned long host_ms = 1;
+
+HostHeap host_heap;
+
+void *host_malloc(size_t n) {
+  host_heap.allocs++;
+  host_heap.bytes += n;
+  host_heap.live++;
+  return malloc(n);
+}
+
+void *host_realloc(void *p, size_t n) {
+  host_heap.allocs++;
+  host_heap.bytes += n;
+  return realloc(p, n);
+}
+
+void host_free(void *p) {
+  host_heap.live--;
+  free(p);
+}
+
+void *operator new(size_t n) { void *p = host_malloc(n ? n : 1); if(!p) throw std::bad_alloc(); return p; }
+void *operator new[](size_t n) { return operator new(n); }
+void operator delete(void *p) noexcept { if(p) host_free(p); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+unsigned long millis() { return host_ms; }
+unsigned long micros() { return host_ms*1000; }
+void host_advance(unsigned long ms) { host_ms += ms; }
+
+HardwareSerial Serial;
+EspClass ESP;
+FS SPIFFS;
+HostFsStats host_fs_stats;
+bool host_fs_fail = false;
+long host_fs_writes_left = -1;
+HostNet host_net;
+ESP8266WiFiClass WiFi;
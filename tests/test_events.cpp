@@ -0,0 +1,43 @@
+/* Door events go straight to the broker while the link is up, and to
+ * the flash outbox while it is down, even though the MQTT client still
+ * believes it is connected. */
+#include <assert.h>
+#include "OpenGarage.h"
+#include "events.h"
+
+MqttStruct OpenGarage::mqtt_config;
+
+static PubSubClient mqtt;
+
+int main() {
+  MqttStruct& cfg = const_cast<MqttStruct&>(OpenGarage::get_mqtt_config());
+  cfg.domain = "broker.example.com";
+  cfg.topic_event = "og/OUT/EVENT";
+  Outbox::begin();
+  Events::begin(&mqtt);
+
+  Events::queue(OUTBOX_DOOR, 1000, "OPEN");
+  assert(mqtt.published.size() == 1);
+  assert(mqtt.published[0] == "og/OUT/EVENT {\"ts\":1000,\"type\":\"door\",\"state\":\"OPEN\"}");
+  assert(Outbox::size() == 0);
+
+  // the link drops, the socket is not closed yet
+  WiFi.link = WL_DISCONNECTED;
+  assert(mqtt.connected());
+  Events::queue(OUTBOX_DOOR, 1010, "CLOSED");
+  Events::queue(OUTBOX_DOOR, 1020, "OPEN");
+  Events::drain();
+  assert(mqtt.published.size() == 1);
+  assert(Outbox::size() == 2);
+
+  // back online, the buffered events go out in order, one per pass
+  WiFi.link = WL_CONNECTED;
+  Events::queue(OUTBOX_DOOR, 1030, "CLOSED");  // behind the buffered ones
+  assert(Outbox::size() == 3);
+  while(Outbox::size()) Events::drain();
+  assert(mqtt.published.size() == 4);
+  assert(mqtt.published[1] == "og/OUT/EVENT {\"ts\":1010,\"type\":\"door\",\"state\":\"CLOSED\"}");
+  assert(mqtt.published[3] == "og/OUT/EVENT {\"ts\":1030,\"type\":\"door\",\"state\":\"CLOSED\"}");
+  printf("test_events: ok\n");
+  return 0;
+}
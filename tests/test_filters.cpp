@@ -0,0 +1,105 @@
+/* MedianFilter against a sorted reference over random samples and
+ * window changes, its accuracy on a noisy echo trace compared to a
+ * plain average, and the cost of push(). */
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "defines.h"
+#include "filters.h"
+
+typedef MedianFilter<uint32_t, DFW_MAX> Filter;
+
+// median of the last w samples, computed the obvious way
+static uint32_t reference(const std::vector<uint32_t>& v, byte w) {
+  size_t n = std::min<size_t>(v.size(), w);
+  if(!n) return 0;
+  std::vector<uint32_t> s(v.end()-n, v.end());
+  std::sort(s.begin(), s.end());
+  if(n&1) return s[n/2];
+  return (s[n/2-1]+s[n/2])/2;
+}
+
+static void against_reference() {
+  std::mt19937 rng(1);
+  Filter f;
+  std::vector<uint32_t> hist;  // samples since the last reset
+  ulong checks = 0;
+  for(int round=0;round<200;round++) {
+    byte w = 1 + rng()%(DFW_MAX+2);  // also out of range, set_window clamps
+    byte before = f.window();
+    f.set_window(w);
+    byte wc = std::min<byte>(std::max<byte>(w, 1), DFW_MAX);
+    assert(f.window() == wc);
+    if(wc != before) hist.clear();  // a new window clears the filter
+    uint32_t range = (round&1) ? 8 : 30000;  // few values force duplicates
+    int n = rng()%(3*DFW_MAX);
+    for(int i=0;i<n;i++) {
+      uint32_t v = rng()%range;
+      f.push(v);
+      hist.push_back(v);
+      assert(f.size() == std::min<size_t>(hist.size(), wc));
+      assert(f.median() == reference(hist, wc));
+      checks++;
+    }
+  }
+  printf("median: %lu samples match the sorted reference\n", checks);
+}
+
+/* A door 120 cm away: echo jitter of a few cm plus dropouts, where
+ * the echo times out or bounces off something closer. */
+static void noise_trace() {
+  std::mt19937 rng(2);
+  std::normal_distribution<double> jitter(0, 2);
+  const uint32_t truth = 120;
+  Filter f;
+  f.set_window(DFW_MAX);
+  std::vector<uint32_t> last;
+  double err_median = 0, err_mean = 0;
+  int n = 0;
+  for(int i=0;i<5000;i++) {
+    uint32_t v = truth + (int)jitter(rng);
+    uint32_t r = rng()%100;
+    if(r<8) v = UD_ECHO_MAX/58;  // timeout
+    else if(r<12) v = 20 + rng()%60;  // ghost echo
+    f.push(v);
+    last.push_back(v);
+    if(last.size()>DFW_MAX) last.erase(last.begin());
+    if(i<DFW_MAX) continue;
+    double mean = 0;
+    for(uint32_t x : last) mean += x;
+    mean /= last.size();
+    err_median += fabs((double)f.median()-truth);
+    err_mean += fabs(mean-truth);
+    n++;
+  }
+  err_median /= n;
+  err_mean /= n;
+  printf("median: mean abs error %.2f cm, plain average %.2f cm (12%% outliers)\n", err_median, err_mean);
+  assert(err_median < 3);
+  assert(err_median*5 < err_mean);
+}
+
+static void timing() {
+  std::mt19937 rng(3);
+  std::vector<uint32_t> v(1<<16);
+  for(auto& x : v) x = rng()%30000;
+  Filter f;
+  f.set_window(DFW_MAX);
+  volatile uint32_t sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for(int k=0;k<20;k++) for(uint32_t x : v) { f.push(x); sink += f.median(); }
+  auto t1 = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(t1-t0).count()/(20.0*v.size());
+  printf("median: %.1f ns per push+median on the host, window %d\n", ns, DFW_MAX);
+}
+
+int main() {
+  against_reference();
+  noise_trace();
+  timing();
+  printf("test_filters: ok\n");
+  return 0;
+}
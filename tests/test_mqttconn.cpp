@@ -0,0 +1,172 @@
+/* The MQTT connect state machine against a stand-in broker that can be
+ * stopped and restarted: DNS, TCP and handshake each take a loop pass,
+ * no pass blocks for longer than its timeout, failed attempts back off
+ * with jitter and the broker address is only resolved again when it
+ * may have changed. */
+#include <assert.h>
+#include "mqttconn.h"
+
+MqttStruct OpenGarage::mqtt_config;
+
+static PubSubClient mqtt;
+static ulong longest;  // ms, longest loop pass
+
+#define PASS_MS 10
+
+static bool pass() {
+  ulong t = millis();
+  bool up = MqttConn::step();
+  if(millis()-t > longest) longest = millis()-t;
+  host_advance(PASS_MS);
+  return up;
+}
+
+// runs passes until the connection comes up or an attempt fails
+static bool attempt() {
+  ulong fails = MqttConn::get_fails();
+  for(int i=0;i<100;i++) {
+    if(pass()) return true;
+    if(MqttConn::get_fails() != fails) return false;
+  }
+  assert(false);
+  return false;
+}
+
+static void connect_steps() {
+  assert(MqttConn::get_state() == MQTT_WAIT);
+  assert(!pass() && MqttConn::get_state() == MQTT_RESOLVE);
+  ulong lookups = host_net.lookups;
+  assert(!pass() && MqttConn::get_state() == MQTT_TCP);
+  assert(host_net.lookups == lookups+1);
+  ulong connects = host_net.connects;
+  assert(!pass() && MqttConn::get_state() == MQTT_HANDSHAKE);
+  assert(host_net.connects == connects+1);
+  assert(pass() && mqtt.connected());
+  assert(MqttConn::get_state() == MQTT_WAIT);
+  assert(MqttConn::get_backoff() == 0);
+}
+
+static void dns_cached() {
+  mqtt.disconnect();
+  MqttConn::reset();
+  ulong lookups = host_net.lookups;
+  assert(attempt());
+  assert(host_net.lookups == lookups);
+}
+
+static void broker_down() {
+  // the broker is killed, the connection is noticed to be gone
+  host_net.connect_ok = false;
+  mqtt.disconnect();
+  longest = 0;
+  ulong lookups = host_net.lookups;
+  assert(!attempt());
+  assert(MqttConn::get_fails() == 1);
+  assert(MqttConn::get_backoff() == MQTT_BACKOFF_MIN);
+  assert(host_net.timeout == MQTT_CONNECT_TIMEOUT);
+  assert(longest <= MQTT_CONNECT_TIMEOUT);
+
+  // retried after half to all of the backoff, resolving the broker again
+  ulong backoff = MqttConn::get_backoff();
+  for(int i=0;i<20;i++) {
+    ulong t = millis();
+    while(MqttConn::get_state() == MQTT_WAIT) pass();
+    ulong waited = millis()-t;
+    assert(waited >= backoff/2 && waited <= backoff+PASS_MS);
+    assert(!attempt());
+    assert(longest <= MQTT_CONNECT_TIMEOUT);
+    backoff = backoff*2 > MQTT_BACKOFF_MAX ? MQTT_BACKOFF_MAX : backoff*2;
+    assert(MqttConn::get_backoff() == backoff);
+  }
+  assert(backoff == MQTT_BACKOFF_MAX);
+  assert(MqttConn::get_fails() == 21);
+  assert(host_net.lookups == lookups+20);  // the first attempt still had a cached address
+
+  // restarted, the next attempt gets through and clears the backoff
+  host_net.connect_ok = true;
+  while(!pass());
+  assert(mqtt.connected());
+  assert(MqttConn::get_backoff() == 0);
+}
+
+static void handshake_timeout() {
+  host_net.mqtt_mute = true;
+  mqtt.disconnect();
+  MqttConn::reset();
+  longest = 0;
+  ulong fails = MqttConn::get_fails();
+  assert(!attempt());
+  assert(MqttConn::get_fails() == fails+1);
+  assert(host_net.timeout == MQTT_CONNECT_TIMEOUT);
+  assert(longest <= MQTT_CONNECT_TIMEOUT);
+  assert(!mqtt.connected());
+  host_net.mqtt_mute = false;
+}
+
+static void dns_failure() {
+  // a new broker name is resolved, and does not resolve
+  MqttStruct& cfg = const_cast<MqttStruct&>(OpenGarage::get_mqtt_config());
+  cfg.domain = "other.example.com";
+  host_net.dns_fail = true;
+  MqttConn::reset();
+  longest = 0;
+  ulong connects = host_net.connects;
+  assert(!attempt());
+  assert(host_net.connects == connects);  // no connect without an address
+  assert(host_net.timeout == MQTT_CONNECT_TIMEOUT);
+  assert(longest <= MQTT_CONNECT_TIMEOUT);
+  host_net.dns_fail = false;
+  MqttConn::reset();
+  assert(attempt());
+}
+
+static void tls_probe() {
+  MqttStruct& cfg = const_cast<MqttStruct&>(OpenGarage::get_mqtt_config());
+  cfg.tls = true;
+  cfg.port = 8883;
+
+  // no fragment length fits, the attempt fails and nothing is remembered
+  host_net.mfln = 0;
+  mqtt.disconnect();
+  MqttConn::reset();
+  assert(!attempt());
+  assert(host_net.probes == 4);  // 512 to 4096
+  assert(MqttConn::get_tls_rx() == 0);
+
+  // the broker accepts 1024, found once per broker
+  host_net.mfln = 1024;
+  MqttConn::reset();
+  assert(attempt());
+  assert(host_net.probes == 6);
+  assert(MqttConn::get_tls_rx() == 1024);
+  mqtt.disconnect();
+  MqttConn::reset();
+  ulong lookups = host_net.lookups;
+  assert(!pass() && MqttConn::get_state() == MQTT_RESOLVE);
+  assert(!pass() && MqttConn::get_state() == MQTT_TCP);  // no probing
+  assert(attempt());
+  assert(host_net.probes == 6);
+  assert(host_net.lookups == lookups);  // the TLS client resolves by name
+}
+
+int main() {
+  MqttStruct& cfg = const_cast<MqttStruct&>(OpenGarage::get_mqtt_config());
+  cfg.domain = "broker.example.com";
+  cfg.port = 1883;
+  cfg.topic = "og";
+  cfg.topic_status = "og/OUT/STATUS";
+  mqtt.up = false;
+  host_net.connect_ok = true;
+  MqttConn::begin(&mqtt);
+  host_advance(1000);
+
+  connect_steps();
+  dns_cached();
+  broker_down();
+  handshake_timeout();
+  dns_failure();
+  tls_probe();
+
+  printf("test_mqttconn: ok\n");
+  return 0;
+}
@@ -0,0 +1,200 @@
+/* Queue logic of the notification dispatcher: a repeated message is
+ * only coalesced with the newest entry, and never with one that is in
+ * flight or already delivered to some of its sinks. Also the timing:
+ * loop() returns while the IFTTT reply is outstanding, a reply after
+ * NOTIFY_TIMEOUT counts as failed, the blocking lookup and connect are
+ * bounded by NOTIFY_CONNECT_TIMEOUT, and the latency counters. */
+#include <assert.h>
+#include "OpenGarage.h"
+#include "notifier.h"
+
+IFTTTStruct OpenGarage::ifttt_config = {"0123456789", "door"};
+MqttStruct OpenGarage::mqtt_config;
+
+static PubSubClient mqtt;
+
+static MqttStruct& mqtt_config() { return const_cast<MqttStruct&>(OpenGarage::get_mqtt_config()); }
+
+// let the IFTTT request in flight complete with the given status line
+static void ifttt_reply(const char *status) {
+  host_net.reply = status;
+  Notifier::loop();
+}
+
+// run loop() until the queue is empty, answering every IFTTT request
+static void drain() {
+  for(int k=0;k<100 && Notifier::get_queued();k++) {
+    Notifier::loop();
+    host_net.reply = "HTTP/1.1 200 OK";
+    host_advance(1000);
+  }
+  assert(!Notifier::get_queued());
+}
+
+static void coalesce_queued() {
+  ulong c = Notifier::get_coalesced();
+  Notifier::push("Door opened");
+  Notifier::push("Door opened");
+  assert(Notifier::get_queued() == 1);
+  assert(Notifier::get_coalesced() == c+1);
+  drain();
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).sent == 1);
+}
+
+static void newest_only() {
+  ulong c = Notifier::get_coalesced();
+  Notifier::push("Door opened");
+  Notifier::push("Door closed");
+  Notifier::push("Door opened");
+  assert(Notifier::get_queued() == 3);
+  assert(Notifier::get_coalesced() == c);
+  ulong sent = Notifier::get_stats(NOTIFY_SINK_IFTTT).sent;
+  drain();
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).sent == sent+3);
+}
+
+static void not_in_flight() {
+  ulong c = Notifier::get_coalesced();
+  Notifier::push("Door opened");
+  Notifier::loop();  // request sent, waiting for the reply
+  Notifier::push("Door opened");
+  assert(Notifier::get_queued() == 2);
+  assert(Notifier::get_coalesced() == c);
+  ulong sent = Notifier::get_stats(NOTIFY_SINK_IFTTT).sent;
+  ifttt_reply("HTTP/1.1 200 OK");
+  assert(Notifier::get_queued() == 1);
+  drain();
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).sent == sent+2);
+}
+
+static void not_delivered() {
+  mqtt_config().domain = "broker.example.com";
+  mqtt_config().topic_notify = "og/OUT/NOTIFY";
+  mqtt.published.clear();
+  ulong c = Notifier::get_coalesced();
+  host_net.connect_ok = false;
+  Notifier::push("Door opened");
+  Notifier::loop();  // MQTT delivered, IFTTT failed and waits for a retry
+  assert(mqtt.published.size() == 1);
+  Notifier::push("Door opened");
+  assert(Notifier::get_queued() == 2);
+  assert(Notifier::get_coalesced() == c);
+  host_net.connect_ok = true;
+  drain();
+  assert(mqtt.published.size() == 2);
+  assert(mqtt.published[1] == "og/OUT/NOTIFY Door opened");
+  assert(Notifier::get_stats(NOTIFY_SINK_MQTT).sent == 2);
+  mqtt_config().domain = "";
+}
+
+static void retry_pending() {
+  ulong c = Notifier::get_coalesced();
+  ulong retries = Notifier::get_stats(NOTIFY_SINK_IFTTT).retries;
+  host_net.connect_ok = false;
+  Notifier::push("Door opened");
+  Notifier::loop();  // connect failed, waiting for the retry
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).retries == retries+1);
+  Notifier::push("Door opened");  // still pending for the same sinks
+  assert(Notifier::get_queued() == 1);
+  assert(Notifier::get_coalesced() == c+1);
+  host_net.connect_ok = true;
+  ulong sent = Notifier::get_stats(NOTIFY_SINK_IFTTT).sent;
+  drain();
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).sent == sent+1);
+}
+
+// one loop pass, returns the ms it blocked for
+static ulong pass() {
+  ulong t = millis();
+  Notifier::loop();
+  return millis()-t;
+}
+
+static void delayed_reply() {
+  NotifyStatStruct st = Notifier::get_stats(NOTIFY_SINK_IFTTT);
+  host_net.reply = "";
+  Notifier::push("Door opened");
+  ulong connects = host_net.connects;
+  assert(pass() == 0);  // request sent
+  assert(host_net.connects == connects+1);
+  // the reply arrives 4 passes of 500 ms later, loop() doesn't wait for it
+  for(int k=0;k<4;k++) {
+    host_advance(500);
+    assert(pass() == 0);
+    assert(Notifier::get_queued() == 1);
+  }
+  host_net.reply = "HTTP/1.1 200 OK";
+  assert(pass() == 0);
+  assert(!Notifier::get_queued());
+  const NotifyStatStruct& s = Notifier::get_stats(NOTIFY_SINK_IFTTT);
+  assert(s.sent == st.sent+1);
+  assert(s.last_ms == 2000);
+  assert(s.max_ms == (st.max_ms > 2000 ? st.max_ms : 2000));
+  assert(s.total_ms == st.total_ms+2000);
+  assert(s.retries == st.retries);
+}
+
+static void reply_timeout() {
+  NotifyStatStruct st = Notifier::get_stats(NOTIFY_SINK_IFTTT);
+  host_net.reply = "";
+  Notifier::push("Door closed");
+  assert(pass() == 0);  // request sent
+  // no reply up to the deadline
+  for(ulong t=0;t<NOTIFY_TIMEOUT;t+=1000) {
+    host_advance(1000);
+    assert(pass() == 0);
+    assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).retries == st.retries);
+  }
+  host_advance(1);
+  assert(pass() == 0);  // deadline passed, counts as failed
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).retries == st.retries+1);
+  assert(Notifier::get_queued() == 1);
+  // retried after NOTIFY_RETRY_BASE, the late reply to the first request is not taken
+  ulong connects = host_net.connects;
+  host_advance(NOTIFY_RETRY_BASE);
+  host_net.reply = "";
+  assert(pass() == 0);
+  assert(host_net.connects == connects+1);
+  host_net.reply = "HTTP/1.1 200 OK";
+  assert(pass() == 0);
+  assert(!Notifier::get_queued());
+  const NotifyStatStruct& s = Notifier::get_stats(NOTIFY_SINK_IFTTT);
+  assert(s.sent == st.sent+1);
+  assert(s.last_ms == NOTIFY_TIMEOUT+1+NOTIFY_RETRY_BASE);
+  assert(s.max_ms == s.last_ms);
+}
+
+static void connect_bounded() {
+  NotifyStatStruct st = Notifier::get_stats(NOTIFY_SINK_IFTTT);
+  host_net.connect_ok = false;
+  Notifier::push("Door opened");
+  assert(pass() == NOTIFY_CONNECT_TIMEOUT);
+  assert(host_net.timeout == NOTIFY_CONNECT_TIMEOUT);
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).retries == st.retries+1);
+  // the failed connect drops the cached address, the lookup fails too
+  host_net.connect_ok = true;
+  host_net.dns_fail = true;
+  host_advance(NOTIFY_RETRY_BASE);
+  ulong connects = host_net.connects;
+  assert(pass() == NOTIFY_CONNECT_TIMEOUT);
+  assert(host_net.timeout == NOTIFY_CONNECT_TIMEOUT);
+  assert(host_net.connects == connects);
+  host_net.dns_fail = false;
+  drain();
+  assert(Notifier::get_stats(NOTIFY_SINK_IFTTT).sent == st.sent+1);
+}
+
+int main() {
+  Notifier::begin(&mqtt);
+  host_net.connect_ok = true;
+  coalesce_queued();
+  newest_only();
+  not_in_flight();
+  retry_pending();
+  not_delivered();
+  delayed_reply();
+  reply_timeout();
+  connect_bounded();
+  printf("test_notifier: ok\n");
+  return 0;
+}